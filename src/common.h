@@ -89,5 +89,6 @@ typedef union
 
 void Error(char *error, ...);
 char *Va(char *str, ...);
+double GetSeconds(void);
 
 #endif
@@ -24,6 +24,7 @@
 #define __KEXARRAY_H__
 
 #include <assert.h>
+#include <utility>
 
 template<class type>
 class kexArray {
@@ -34,6 +35,7 @@ public:
 
     void                Push(type o);
     void                Pop(void);
+    void                Reserve(const unsigned int size);
     void                Empty(void);
     void                EmptyContents(void);
     type                IndexOf(unsigned int index) const;
@@ -47,6 +49,7 @@ public:
 protected:
     type                *data;
     unsigned int        length;
+    unsigned int        capacity;
     bool                bPointer;
 };
 
@@ -66,6 +69,7 @@ template<class type>
 kexArray<type>::kexArray() {
     data = NULL;
     length = 0;
+    capacity = 0;
     bPointer = false;
 }
 
@@ -76,6 +80,7 @@ template<class type>
 kexArray<type>::kexArray(bool bIsPointer) {
     data = NULL;
     length = 0;
+    capacity = 0;
     bPointer = bIsPointer;
 }
 
@@ -89,58 +94,56 @@ kexArray<type>::~kexArray() {
 }
 
 //
-// kexArray::Push
+// kexArray::Reserve
+//
+// Makes room for at least size elements without changing the length
 //
 template<class type>
-void kexArray<type>::Push(type o) {
-    if(length == 0) {
-        data = new type[length+1];
-        data[length] = o;
-    }
-    else {
-        type *tmp = data;
-        data = new type[length+1];
-        for(unsigned int i = 0; i < length; i++)
-            data[i] = tmp[i];
+void kexArray<type>::Reserve(const unsigned int size) {
+    if(size <= capacity)
+        return;
+
+    type *tmp = data;
+    data = new type[size];
 
+    for(unsigned int i = 0; i < length; i++)
+        data[i] = std::move(tmp[i]);
+
+    if(tmp)
         delete[] tmp;
-        data[length] = o;
-    }
 
-    length++;
+    capacity = size;
+}
+
+//
+// kexArray::Push
+//
+// Capacity doubles whenever it runs out so pushes are amortized O(1)
+//
+template<class type>
+void kexArray<type>::Push(type o) {
+    if(length == capacity)
+        Reserve(capacity == 0 ? 16 : capacity * 2);
+
+    data[length++] = std::move(o);
 }
 
 //
 // kexArray::Pop
 //
+// Keeps the storage around for the next push
+//
 template<class type>
 void kexArray<type>::Pop(void) {
     if(length == 0)
         return;
 
-    if(length != 1) {
-        type *tmp = data;
-        
-        data = new type[length-1];
-
-        for(unsigned int i = 0; i < length-1; i++)
-            data[i] = tmp[i];
-        if(bPointer) {
-            delete tmp[length-1];
-            tmp[length-1] = NULL;
-        }
+    length--;
 
-        delete[] tmp;
+    if(bPointer) {
+        delete data[length];
+        data[length] = NULL;
     }
-    else {
-        if(bPointer) {
-            delete data[0];
-        }
-        delete[] data;
-        data = NULL;
-    }
-
-    length--;
 }
 
 //
@@ -148,9 +151,17 @@ void kexArray<type>::Pop(void) {
 //
 template<class type>
 void kexArray<type>::Empty(void) {
-    while(length) {
-        Pop();
+    if(bPointer) {
+        for(unsigned int i = 0; i < length; i++)
+            delete data[i];
     }
+
+    if(data)
+        delete[] data;
+
+    data = NULL;
+    length = 0;
+    capacity = 0;
 }
 
 //
@@ -196,6 +207,7 @@ void kexArray<type>::Splice(const unsigned int start, unsigned int len) {
     delete[] data;
     data = tmp;
     length = length - len;
+    capacity = len;
 }
 
 //
@@ -29,6 +29,13 @@
 
 #include <cerrno>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 #include "common.h"
 #include "kexlib/binFile.h"
 
@@ -40,6 +47,9 @@ kexBinFile::kexBinFile(void) {
     this->handle = NULL;
     this->buffer = NULL;
     this->bufferOffset = 0;
+    this->mappedLength = 0;
+    this->bufferLength = 0;
+    this->descriptor = -1;
     this->bOpened = false;
 }
 
@@ -72,6 +82,7 @@ bool kexBinFile::Open(const char *file, kexHeapBlock &heapBlock) {
             if(length > 0) {
                 bOpened = true;
                 bufferOffset = 0;
+                bufferLength = (int)length;
                 return true;
             }
         }
@@ -84,6 +95,44 @@ bool kexBinFile::Open(const char *file, kexHeapBlock &heapBlock) {
     return false;
 }
 
+//
+// kexBinFile::OpenMapped
+//
+// Maps the file so only the pages that are actually touched get read
+// in. The mapping is private, so callers that patch lump data in place
+// (thing lights do) get copy-on-write pages and the file stays as is.
+// Falls back to Open if the file can't be mapped
+//
+
+bool kexBinFile::OpenMapped(const char *file, kexHeapBlock &heapBlock) {
+#ifndef _WIN32
+    struct stat st;
+    void *ptr;
+    int fd;
+
+    if((fd = open(file, O_RDONLY)) != -1) {
+        if(fstat(fd, &st) == 0 && st.st_size > 0) {
+            ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+
+            if(ptr != MAP_FAILED) {
+                // the descriptor is kept for CopyFrom
+                descriptor = fd;
+                buffer = (byte*)ptr;
+                mappedLength = st.st_size;
+                bufferLength = (int)st.st_size;
+                bOpened = true;
+                bufferOffset = 0;
+                return true;
+            }
+        }
+
+        close(fd);
+    }
+#endif
+
+    return Open(file, heapBlock);
+}
+
 //
 // kexBinFile::Create
 //
@@ -101,19 +150,42 @@ bool kexBinFile::Create(const char *file) {
 //
 // kexBinFile::Close
 //
+// Returns false if anything written to the file didn't make it out
+//
+
+bool kexBinFile::Close(void) {
+    bool bWritten = true;
 
-void kexBinFile::Close(void) {
     if(bOpened == false) {
-        return;
+        return true;
     }
     if(handle) {
-        fclose(handle);
+        if(ferror(handle)) {
+            bWritten = false;
+        }
+        // buffered writes can still fail while being flushed
+        if(fclose(handle) != 0) {
+            bWritten = false;
+        }
+        handle = NULL;
         if(buffer) {
             Mem_Free(buffer);
         }
     }
+#ifndef _WIN32
+    if(mappedLength != 0) {
+        munmap(buffer, mappedLength);
+        buffer = NULL;
+        mappedLength = 0;
+    }
+    if(descriptor != -1) {
+        close(descriptor);
+        descriptor = -1;
+    }
+#endif
 
     bOpened = false;
+    return bWritten;
 }
 
 //
@@ -173,6 +245,11 @@ int kexBinFile::Length(void) {
         return 0;
     }
 
+    // the whole file was read or mapped in
+    if(handle == NULL) {
+        return bufferLength;
+    }
+
     // save the current position in the file
     savedpos = ftell(handle);
     
@@ -317,6 +394,87 @@ void kexBinFile::WriteVector(const kexVec3 &val) {
     WriteFloat(val.z);
 }
 
+//
+// kexBinFile::WriteBytes
+//
+
+void kexBinFile::WriteBytes(const byte *data, const int length) {
+    if(length <= 0) {
+        return;
+    }
+
+    if(bOpened) {
+        fwrite(data, 1, length, handle);
+    }
+    else {
+        memcpy(&buffer[bufferOffset], data, length);
+    }
+    bufferOffset += length;
+}
+
+//
+// kexBinFile::WriteArray
+//
+// Writes the values little endian, staged through a small
+// buffer so large arrays still go out as a few block writes
+//
+
+void kexBinFile::WriteArray(const short *vals, const int count) {
+    byte chunk[4096];
+    int num;
+    int i;
+    int j;
+
+    for(i = 0; i < count; i += num) {
+        num = MIN(count - i, (int)sizeof(chunk) / 2);
+
+        for(j = 0; j < num; j++) {
+            chunk[j * 2 + 0] = vals[i + j] & 0xff;
+            chunk[j * 2 + 1] = (vals[i + j] >> 8) & 0xff;
+        }
+
+        WriteBytes(chunk, num * 2);
+    }
+}
+
+//
+// kexBinFile::CopyFrom
+//
+// Appends a byte range of another file. On linux the kernel copies
+// it straight between the two files with copy_file_range, otherwise
+// (or if the filesystem refuses) it's written out of the source buffer
+//
+
+void kexBinFile::CopyFrom(const kexBinFile &src, const int offset, const int length) {
+    int copied = 0;
+
+#ifdef __linux__
+    loff_t srcOffset = offset;
+    ssize_t result;
+
+    if(bOpened && src.descriptor != -1) {
+        fflush(handle);
+
+        while(copied < length) {
+            result = copy_file_range(src.descriptor, &srcOffset, fileno(handle), NULL,
+                                     length - copied, 0);
+
+            if(result <= 0) {
+                break;
+            }
+
+            copied += (int)result;
+        }
+
+        // the descriptor moved underneath stdio, resync it
+        fseek(handle, 0, SEEK_END);
+        bufferOffset += copied;
+    }
+#endif
+
+    WriteBytes(&src.buffer[offset + copied], length - copied);
+}
+
 //
 // kexBinFile::WriteString
 //
@@ -33,8 +33,9 @@ public:
                         ~kexBinFile(void);
 
     bool                Open(const char *file, kexHeapBlock &heapBlock = hb_static);
+    bool                OpenMapped(const char *file, kexHeapBlock &heapBlock = hb_static);
     bool                Create(const char *file);
-    void                Close(void);
+    bool                Close(void);
     bool                Exists(const char *file);
     int                 Length(void);
     void                Duplicate(const char *newFileName);
@@ -52,6 +53,9 @@ public:
     void                WriteFloat(const float val);
     void                WriteVector(const kexVec3 &val);
     void                WriteString(const kexStr &val);
+    void                WriteBytes(const byte *data, const int length);
+    void                WriteArray(const short *vals, const int count);
+    void                CopyFrom(const kexBinFile &src, const int offset, const int length);
 
     int                 GetOffsetValue(int id);
     byte                *GetOffset(int id,
@@ -63,12 +67,16 @@ public:
     void                SetBuffer(byte *ptr) { buffer = ptr; }
     byte                *BufferAt(void) const { return &buffer[bufferOffset]; }
     bool                Opened(void) const { return bOpened; }
+    bool                Mapped(void) const { return mappedLength != 0; }
     void                SetOffset(const int offset) { bufferOffset = offset; }
 
 private:
     FILE                *handle;
     byte                *buffer;
     unsigned int        bufferOffset;
+    size_t              mappedLength;
+    int                 bufferLength;
+    int                 descriptor;
     bool                bOpened;
 };
 
@@ -43,18 +43,25 @@ kexHeapBlock hb_auto("auto", false, NULL, NULL);
 kexHeapBlock hb_file("file", false, NULL, NULL);
 kexHeapBlock hb_object("object", false, NULL, NULL);
 
+// per-map geometry. allocations are only ever released all at once
+kexHeapBlock hb_map("map", false, NULL, NULL, true);
+
 //
 // kexHeapBlock::kexHeapBlock
 //
 
 kexHeapBlock::kexHeapBlock(const char *name, bool bGarbageCollect,
-                           blockFunc_t funcFree, blockFunc_t funcGC) {
+                           blockFunc_t funcFree, blockFunc_t funcGC,
+                           bool arena) {
     this->name      = (char*)name;
     this->freeFunc  = funcFree;
     this->gcFunc    = funcGC;
     this->blocks    = NULL;
     this->bGC       = bGarbageCollect;
     this->purgeID   = kexHeap::numHeapBlocks++;
+    this->bArena    = arena;
+    this->arenaPtr  = NULL;
+    this->arenaLeft = 0;
 
     // add heap block to main block list
     if(kexHeap::blockList) {
@@ -164,14 +171,12 @@ memBlock_t *kexHeap::GetBlock(void *ptr, const char *file, int line) {
 }
 
 //
-// kexHeap::Malloc
+// kexHeap::NewBlock
 //
 
-void *kexHeap::Malloc(int size, kexHeapBlock &heapBlock, const char *file, int line) {
+memBlock_t *kexHeap::NewBlock(int size, kexHeapBlock &heapBlock, const char *file, int line) {
     memBlock_t *newblock;
 
-    assert(size > 0);
-
     newblock = NULL;
 
     if(!(newblock = (memBlock_t*)malloc(sizeof(memBlock_t) + size))) {
@@ -185,7 +190,51 @@ void *kexHeap::Malloc(int size, kexHeapBlock &heapBlock, const char *file, int l
 
     kexHeap::AddBlock(newblock, &heapBlock);
 
-    return ((byte*)newblock) + sizeof(memBlock_t);
+    return newblock;
+}
+
+//
+// kexHeap::ArenaMalloc
+//
+// Hands out consecutive pieces of large chunks, so allocations made one
+// after another end up next to each other. The pieces have no block
+// header of their own and can't be freed or reallocated, only purged
+// along with the whole heap block
+//
+
+void *kexHeap::ArenaMalloc(int size, kexHeapBlock &heapBlock, const char *file, int line) {
+    memBlock_t *chunk;
+    byte *ptr;
+
+    // keep every piece 16 byte aligned
+    size = (size + 15) & ~15;
+
+    if(size > heapBlock.arenaLeft) {
+        chunk = kexHeap::NewBlock(MAX(size, ArenaChunkSize), heapBlock, file, line);
+
+        heapBlock.arenaPtr = ((byte*)chunk) + sizeof(memBlock_t);
+        heapBlock.arenaLeft = chunk->size;
+    }
+
+    ptr = heapBlock.arenaPtr;
+    heapBlock.arenaPtr += size;
+    heapBlock.arenaLeft -= size;
+
+    return ptr;
+}
+
+//
+// kexHeap::Malloc
+//
+
+void *kexHeap::Malloc(int size, kexHeapBlock &heapBlock, const char *file, int line) {
+    assert(size > 0);
+
+    if(heapBlock.bArena) {
+        return kexHeap::ArenaMalloc(size, heapBlock, file, line);
+    }
+
+    return ((byte*)kexHeap::NewBlock(size, heapBlock, file, line)) + sizeof(memBlock_t);
 }
 
 //
@@ -291,6 +340,8 @@ void kexHeap::Purge(kexHeapBlock &heapBlock, const char *file, int line) {
     }
 
     heapBlock.blocks = NULL;
+    heapBlock.arenaPtr = NULL;
+    heapBlock.arenaLeft = 0;
 }
 
 //
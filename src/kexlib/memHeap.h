@@ -42,7 +42,8 @@ typedef struct memBlock_s {
 class kexHeapBlock {
 public:
                             kexHeapBlock(const char *name, bool bGarbageCollect,
-                                blockFunc_t funcFree, blockFunc_t funcGC);
+                                blockFunc_t funcFree, blockFunc_t funcGC,
+                                bool arena = false);
                             ~kexHeapBlock(void);
 
     kexHeapBlock            *operator[](int index);
@@ -53,6 +54,9 @@ public:
     blockFunc_t             freeFunc;
     blockFunc_t             gcFunc;
     int                     purgeID;
+    bool                    bArena;
+    byte                    *arenaPtr;
+    int                     arenaLeft;
     kexHeapBlock            *prev;
     kexHeapBlock            *next;
 };
@@ -77,17 +81,21 @@ public:
     static kexHeapBlock     *blockList;
 
 private:
+    static memBlock_t       *NewBlock(int size, kexHeapBlock &heapBlock, const char *file, int line);
+    static void             *ArenaMalloc(int size, kexHeapBlock &heapBlock, const char *file, int line);
     static void             AddBlock(memBlock_t *block, kexHeapBlock *heapBlock);
     static void             RemoveBlock(memBlock_t *block);
     static memBlock_t       *GetBlock(void *ptr, const char *file, int line);
     
     static const int        HeapTag = 0x03151983;
+    static const int        ArenaChunkSize = 0x100000;
 };
 
 extern kexHeapBlock hb_static;
 extern kexHeapBlock hb_auto;
 extern kexHeapBlock hb_file;
 extern kexHeapBlock hb_object;
+extern kexHeapBlock hb_map;
 
 #define Mem_Malloc(s, hb)       (kexHeap::Malloc(s, hb, __FILE__,__LINE__))
 #define Mem_Calloc(s, hb)       (kexHeap::Calloc(s, hb, __FILE__,__LINE__))
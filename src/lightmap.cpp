@@ -30,11 +30,13 @@
 #include "common.h"
 #include "surfaces.h"
 #include "trace.h"
+#include "worker.h"
 #include "mapData.h"
 #include "lightmap.h"
 #include "kexlib/binFile.h"
 
 //#define EXPORT_TEXELS_OBJ
+//#define VERIFY_ADAPTIVE_SAMPLES
 
 //
 // kexLightmapBuilder::kexLightmapBuilder
@@ -46,9 +48,31 @@ kexLightmapBuilder::kexLightmapBuilder(void) {
     this->allocBlocks   = NULL;
     this->numTextures   = 0;
     this->samples       = 16;
-    this->extraSamples  = 2;
+    this->extraSamples  = 0;
+    this->packer        = LIGHTMAP_PACKER_SKYLINE;
+    this->dedupeTolerance = -1;
+    this->encoding      = LIGHTMAP_ENCODING_RAW;
     this->ambience      = 0.0f;
     this->tracedTexels  = 0;
+    this->culledTraces  = 0;
+    this->cachedSurfaces = 0;
+    this->cacheFile     = NULL;
+    this->adaptiveThreshold = -1;
+    this->interpolatedTexels = 0;
+    this->maxAdaptiveError = 0;
+    this->numThreads    = 1;
+    this->threads       = NULL;
+
+    this->lightGrid         = NULL;
+    this->lightGridLights   = NULL;
+    this->surfaceLights     = NULL;
+    this->surfaceLightNums  = NULL;
+    this->ceilingLights     = NULL;
+    this->surfaceKeys       = NULL;
+    this->surfaceTexels     = NULL;
+    this->blockOwners       = NULL;
+    this->cacheEntries      = NULL;
+    this->numCacheEntries   = 0;
 }
 
 //
@@ -56,6 +80,33 @@ kexLightmapBuilder::kexLightmapBuilder(void) {
 //
 
 kexLightmapBuilder::~kexLightmapBuilder(void) {
+    if(threads) {
+        delete[] threads;
+    }
+}
+
+//
+// kexLightmapBuilder::Reset
+//
+// Drops everything left over from the last map so the builder can
+// light another one. Called before the map's memory gets purged
+//
+
+void kexLightmapBuilder::Reset(void) {
+    ResetPages();
+
+    if(blockOwners) {
+        Mem_Free(blockOwners);
+        blockOwners = NULL;
+    }
+
+    thingLights.Empty();
+
+    tracedTexels = 0;
+    culledTraces = 0;
+    cachedSurfaces = 0;
+    interpolatedTexels = 0;
+    maxAdaptiveError = 0;
 }
 
 //
@@ -100,6 +151,126 @@ void kexLightmapBuilder::AddThingLights(kexDoomMap &doomMap) {
 
     lightInfos = doomMap.lightInfos;
     printf("\n");
+
+    SetupCeilingLights(doomMap);
+    BuildLightGrid();
+}
+
+//
+// kexLightmapBuilder::BuildLightGrid
+//
+// Sorts the point lights into a grid of map cells by the reach of their
+// radius, so each surface only has to look at the lights near it
+//
+
+void kexLightmapBuilder::BuildLightGrid(void) {
+    mapThing_t *light;
+    float radius;
+    float lo[2];
+    float hi[2];
+    int cellMin[2];
+    int cellMax[2];
+    int *cellCount;
+    int numCells;
+    int total;
+    int x;
+    int y;
+    int j;
+    unsigned int i;
+
+    lo[0] = lo[1] = M_INFINITY;
+    hi[0] = hi[1] = -M_INFINITY;
+
+    for(i = 0; i < thingLights.Length(); i++) {
+        light = thingLights[i];
+
+        if(light->type == TYPE_DIRECTIONAL_CEILING) {
+            continue;
+        }
+
+        radius = 50.0f * light->angle;
+
+        if(light->x - radius < lo[0]) lo[0] = light->x - radius;
+        if(light->y - radius < lo[1]) lo[1] = light->y - radius;
+        if(light->x + radius > hi[0]) hi[0] = light->x + radius;
+        if(light->y + radius > hi[1]) hi[1] = light->y + radius;
+    }
+
+    if(lo[0] > hi[0]) {
+        // no point lights
+        lo[0] = lo[1] = hi[0] = hi[1] = 0;
+    }
+
+    lightGridCellSize = LIGHTGRID_CELL_SIZE;
+
+    for(j = 0; j < 2; j++) {
+        if((hi[j] - lo[j]) / lightGridCellSize > LIGHTGRID_MAX_CELLS) {
+            lightGridCellSize = (hi[j] - lo[j]) / LIGHTGRID_MAX_CELLS;
+        }
+    }
+
+    for(j = 0; j < 2; j++) {
+        lightGridOrigin[j] = lo[j];
+        lightGridSize[j] = (int)((hi[j] - lo[j]) / lightGridCellSize) + 1;
+
+        if(lightGridSize[j] > LIGHTGRID_MAX_CELLS) {
+            lightGridSize[j] = LIGHTGRID_MAX_CELLS;
+        }
+    }
+
+    numCells = lightGridSize[0] * lightGridSize[1];
+    lightGrid = (lightList_t*)Mem_Calloc(sizeof(lightList_t) * numCells, hb_static);
+    cellCount = (int*)Mem_Calloc(sizeof(int) * numCells, hb_static);
+    total = 0;
+
+    // count first so every cell gets one contiguous run of lights
+    for(int pass = 0; pass < 2; pass++) {
+        for(i = 0; i < thingLights.Length(); i++) {
+            light = thingLights[i];
+
+            if(light->type == TYPE_DIRECTIONAL_CEILING) {
+                continue;
+            }
+
+            radius = 50.0f * light->angle;
+
+            for(j = 0; j < 2; j++) {
+                float org = (float)(j == 0 ? light->x : light->y);
+
+                cellMin[j] = (int)((org - radius - lightGridOrigin[j]) / lightGridCellSize);
+                cellMax[j] = (int)((org + radius - lightGridOrigin[j]) / lightGridCellSize);
+
+                if(cellMin[j] < 0) cellMin[j] = 0;
+                if(cellMax[j] >= lightGridSize[j]) cellMax[j] = lightGridSize[j] - 1;
+            }
+
+            for(y = cellMin[1]; y <= cellMax[1]; y++) {
+                for(x = cellMin[0]; x <= cellMax[0]; x++) {
+                    int cell = y * lightGridSize[0] + x;
+
+                    if(pass == 0) {
+                        lightGrid[cell].count++;
+                    }
+                    else {
+                        lightGridLights[lightGrid[cell].first + cellCount[cell]++] = i;
+                    }
+                }
+            }
+        }
+
+        if(pass == 0) {
+            for(j = 0; j < numCells; j++) {
+                lightGrid[j].first = total;
+                total += lightGrid[j].count;
+            }
+
+            lightGridLights = (int*)Mem_Calloc(sizeof(int) * (total + 1), hb_static);
+        }
+    }
+
+    Mem_Free(cellCount);
+
+    printf("Light grid: %ix%i cells, %i entries\n\n", lightGridSize[0], lightGridSize[1], total);
 }
 
 //
@@ -171,255 +342,1420 @@ bool kexLightmapBuilder::MakeRoomForBlock(const int width, const int height,
 }
 
 //
-// kexLightmapBuilder::GetBoundsFromSurface
+// kexLightmapBuilder::PlaceSurface
 //
 
-kexBBox kexLightmapBuilder::GetBoundsFromSurface(const surface_t *surface) {
-    kexVec3 low(M_INFINITY, M_INFINITY, M_INFINITY);
-    kexVec3 hi(-M_INFINITY, -M_INFINITY, -M_INFINITY);
-
-    kexBBox bounds;
-    bounds.Clear();
-
-    for(int i = 0; i < surface->numVerts; i++) {
-        for(int j = 0; j < 3; j++) {
-            if(surface->verts[i][j] < low[j]) {
-                low[j] = surface->verts[i][j];
-            }
-            if(surface->verts[i][j] > hi[j]) {
-                hi[j] = surface->verts[i][j];
-            }
-        }
-    }
-
-    bounds.min = low;
-    bounds.max = hi;
-
-    return bounds;
+void kexLightmapBuilder::PlaceSurface(surface_t *surface, const int page, const int x, const int y) {
+    surface->lightmapNum = page;
+    surface->lightmapOffs[0] = x;
+    surface->lightmapOffs[1] = y;
 }
 
 //
-// kexLightmapBuilder::EmitFromCeiling
+// kexLightmapBuilder::SetTexCoords
+//
+// Moves the texture coordinates from block space into the page
+// once the final layout is known
 //
 
-bool kexLightmapBuilder::EmitFromCeiling(const kexVec3 &origin, const kexVec3 &normal,
-                                         const mapThing_t *light, float *dist) {
-    mapSubSector_t *sub;
-    mapSubSector_t *tSub;
-    mapSector_t *sector;
-    surface_t *surf;
-    kexVec3 dir;
-    int num;
+void kexLightmapBuilder::SetTexCoords(surface_t *surface) {
+    int x = surface->lightmapOffs[0];
+    int y = surface->lightmapOffs[1];
     int i;
-    unsigned int k;
 
-    if(!(sub = map->PointInSubSector(light->x, light->y))) {
-        return false;
-    }
-    if(!(sector = map->GetSectorFromSubSector(sub))) {
-        return false;
+    for(i = 0; i < surface->numVerts; i++) {
+        surface->lightmapCoords[i * 2 + 0] =
+            (surface->lightmapCoords[i * 2 + 0] + x + 0.5f) / (float)textureWidth;
+        surface->lightmapCoords[i * 2 + 1] =
+            (surface->lightmapCoords[i * 2 + 1] + y + 0.5f) / (float)textureHeight;
     }
+}
 
-    num = sub - map->mapSSects;
-    surf = NULL;
+//
+// kexLightmapBuilder::AllocateSkylineBlock
+//
 
-    for(k = 0; k < surfaces.Length(); k++) {
-        if(surfaces[k]->type != ST_CEILING) {
-            continue;
-        }
+void kexLightmapBuilder::AllocateSkylineBlock(surface_t *surface) {
+    int width = surface->lightmapDims[0];
+    int height = surface->lightmapDims[1];
+    int x;
+    int y;
 
-        if(surfaces[k]->typeIndex == num) {
-            surf = surfaces[k];
-            break;
+    // make room for new lightmap block
+    if(!MakeRoomForBlock(width, height, &x, &y)) {
+        NewTexture();
+        if(!MakeRoomForBlock(width, height, &x, &y)) {
+            Error("Lightmap allocation failed\n");
+            return;
         }
     }
 
-    if(surf == NULL) {
-        return false;
-    }
+    PlaceSurface(surface, numTextures - 1, x, y);
+}
+
+//
+// CompareBlockSizes
+//
+// Tallest blocks first, then widest. Ties keep surface order
+//
 
-    dir = kexVec3(0, 0, 1);
+static int CompareBlockSizes(const void *a, const void *b) {
+    surface_t *s1 = surfaces[*(const int*)a];
+    surface_t *s2 = surfaces[*(const int*)b];
 
-    for(i = 0; i < map->numThings; i++) {
-        mapThing_t *thing = &map->mapThings[i];
+    if(s1->lightmapDims[1] != s2->lightmapDims[1]) {
+        return s2->lightmapDims[1] - s1->lightmapDims[1];
+    }
 
-        if(thing->type != TYPE_DIRECTIONAL_TARGET) {
-            continue;
-        }
+    if(s1->lightmapDims[0] != s2->lightmapDims[0]) {
+        return s2->lightmapDims[0] - s1->lightmapDims[0];
+    }
 
-        if(thing->tid != light->tid) {
-            continue;
-        }
+    return *(const int*)a - *(const int*)b;
+}
+
+//
+// AddFreeRect
+//
 
-        dir = kexVec3(F(light->x << 16), F(light->y << 16), F(light->z << 16)) -
-            kexVec3(F(thing->x << 16), F(thing->y << 16), F(thing->z << 16));
+static void AddFreeRect(packPage_t *page, const int x, const int y,
+                        const int width, const int height) {
+    packRect_t *rect;
 
-        dir.Normalize();
-        break;
+    if(page->numFreeRects == page->maxFreeRects) {
+        page->maxFreeRects = page->maxFreeRects ? page->maxFreeRects * 2 : 64;
+        page->freeRects = (packRect_t*)Mem_Realloc(page->freeRects,
+            sizeof(packRect_t) * page->maxFreeRects, hb_static);
     }
 
-    *dist = normal.Dot(dir);
+    rect = &page->freeRects[page->numFreeRects++];
+    rect->x = x;
+    rect->y = y;
+    rect->width = width;
+    rect->height = height;
+}
 
-    if(*dist <= 0) {
-        return false;
-    }
+//
+// FindMaxRectsPosition
+//
+// Best short side fit: the free rect that leaves the least room
+// on its tighter side wins
+//
 
-    trace.Trace(origin, origin + (dir * 32768));
+static bool FindMaxRectsPosition(const packPage_t *page, const int width, const int height,
+                                 int *x, int *y) {
+    packRect_t *rect;
+    int bestShort = D_MAXINT;
+    int bestLong = D_MAXINT;
+    int leftShort;
+    int leftLong;
+    int i;
 
-    if(trace.fraction == 1 || trace.hitSurface == NULL) {
-        return false;
-    }
+    for(i = 0; i < page->numFreeRects; i++) {
+        rect = &page->freeRects[i];
 
-    if(trace.hitSurface->type != ST_CEILING) {
-        return false;
-    }
+        if(rect->width < width || rect->height < height) {
+            continue;
+        }
 
-    tSub = &map->mapSSects[trace.hitSurface->typeIndex];
+        leftShort = MIN(rect->width - width, rect->height - height);
+        leftLong = MAX(rect->width - width, rect->height - height);
 
-    if(map->GetSectorFromSubSector(tSub) != sector ||
-        trace.hitSurface->type != ST_CEILING) {
-            return false;
+        if(leftShort < bestShort || (leftShort == bestShort && leftLong < bestLong)) {
+            bestShort = leftShort;
+            bestLong = leftLong;
+            *x = rect->x;
+            *y = rect->y;
+        }
     }
 
-    return true;
+    return bestShort != D_MAXINT;
 }
 
 //
-// kexLightmapBuilder::LightTexelSample
+// SplitMaxRects
+//
+// Cuts the placed block out of every free rect it overlaps, keeping the
+// largest rects left over on each side, then drops the rects that are
+// now inside other ones
 //
 
-kexVec3 kexLightmapBuilder::LightTexelSample(const kexVec3 &origin, kexPlane &plane) {
-    mapThing_t *light;
-    kexVec3 lightOrigin;
-    kexVec3 dir;
-    kexVec3 color;
+static void SplitMaxRects(packPage_t *page, const int x, const int y,
+                          const int width, const int height) {
+    packRect_t rect;
+    packRect_t *a;
+    packRect_t *b;
+    int count;
+    int i;
     int j;
-    float dist;
-    float radius;
-    float intensity;
-    float colorAdd;
-    mapLightInfo_t *lInfo;
-    mapLightInfo_t lInfo2;
-
-    color.Clear();
 
-    for(unsigned int i = 0; i < thingLights.Length(); i++) {
-        light = thingLights[i];
-        lightOrigin.Set(F(light->x << 16), F(light->y << 16), F(light->z << 16));
+    count = page->numFreeRects;
 
-        if(ambience > 0.0f) {
-            for(j = 0; j < 3; j++) {
-                color[j] += ambience;
-                if(color[j] > 1.0f) color[j] = 1.0f;
-                if(color[j] < 0.0f) color[j] = 0.0f;
-            }
-        }
+    for(i = 0; i < count; i++) {
+        rect = page->freeRects[i];
 
-        if(plane.Distance(lightOrigin) - plane.d < 0) {
+        if(x >= rect.x + rect.width || x + width <= rect.x ||
+           y >= rect.y + rect.height || y + height <= rect.y) {
             continue;
         }
 
-        radius = 50.0f * light->angle;
-
-        if(light->options <= 255) {
-            lInfo2.rgba[0] = (byte)light->options;
-            lInfo2.rgba[1] = (byte)light->options;
-            lInfo2.rgba[2] = (byte)light->options;
-            lInfo2.rgba[3] = 0;
-            lInfo2.tag = 0;
+        if(x > rect.x) {
+            AddFreeRect(page, rect.x, rect.y, x - rect.x, rect.height);
         }
-        else {
-            lInfo2 = lightInfos[light->options - 256];
+        if(x + width < rect.x + rect.width) {
+            AddFreeRect(page, x + width, rect.y, rect.x + rect.width - (x + width), rect.height);
+        }
+        if(y > rect.y) {
+            AddFreeRect(page, rect.x, rect.y, rect.width, y - rect.y);
+        }
+        if(y + height < rect.y + rect.height) {
+            AddFreeRect(page, rect.x, y + height, rect.width, rect.y + rect.height - (y + height));
         }
 
-        lInfo = &lInfo2;
+        // mark as used up
+        page->freeRects[i].width = 0;
+    }
 
-        //intensity = lInfo->rgba[3];
-        intensity = 8;
+    for(i = 0; i < page->numFreeRects; i++) {
+        a = &page->freeRects[i];
 
-        if(intensity < 1.0f) {
-            intensity = 1.0f;
+        if(a->width == 0) {
+            continue;
         }
 
-        if(light->type == TYPE_DIRECTIONAL_CEILING) {
-            if(!EmitFromCeiling(origin, plane.Normal(), light, &dist)) {
+        for(j = 0; j < page->numFreeRects; j++) {
+            b = &page->freeRects[j];
+
+            if(i == j || b->width == 0) {
                 continue;
             }
 
-            for(j = 0; j < 3; j++) {
-                color[j] += (/*dist **/ ((float)lInfo->rgba[j] / 255.0f));
-                if(color[j] > 1.0f) color[j] = 1.0f;
-                if(color[j] < 0.0f) color[j] = 0.0f;
+            if(a->x >= b->x && a->y >= b->y &&
+               a->x + a->width <= b->x + b->width &&
+               a->y + a->height <= b->y + b->height) {
+                a->width = 0;
+                break;
             }
+        }
+    }
 
-            tracedTexels++;
-            continue;
+    count = 0;
+
+    for(i = 0; i < page->numFreeRects; i++) {
+        if(page->freeRects[i].width != 0) {
+            page->freeRects[count++] = page->freeRects[i];
         }
+    }
+
+    page->numFreeRects = count;
+}
+
+//
+// kexLightmapBuilder::PackMaxRects
+//
+// Places the blocks largest first, each one going into the first
+// page with a free rect that can hold it
+//
+
+void kexLightmapBuilder::PackMaxRects(void) {
+    packPage_t *pages;
+    surface_t *surface;
+    int *order;
+    int count;
+    int numPages;
+    int x;
+    int y;
+    int p;
+    unsigned int i;
+
+    order = (int*)Mem_Calloc(sizeof(int) * (surfaces.Length() + 1), hb_static);
+    pages = NULL;
+    numPages = 0;
 
-        trace.Trace(lightOrigin, origin);
+    count = 0;
 
-        if(trace.fraction != 1) {
+    for(i = 0; i < surfaces.Length(); i++) {
+        if(blockOwners && blockOwners[i] != (int)i) {
             continue;
         }
 
-        dir = (lightOrigin - origin);
-        dist = dir.Unit();
+        order[count++] = i;
+    }
+
+    qsort(order, count, sizeof(int), CompareBlockSizes);
+
+    for(i = 0; i < (unsigned int)count; i++) {
+        surface = surfaces[order[i]];
 
-        if(light->type == TYPE_LIGHTPOINT_WEAK) {
-            if(dist < 128) {
-                dist = 128;
+        for(p = 0; p < numPages; p++) {
+            if(FindMaxRectsPosition(&pages[p], surface->lightmapDims[0],
+                surface->lightmapDims[1], &x, &y)) {
+                break;
             }
         }
 
-        dir.Normalize();
+        if(p == numPages) {
+            NewTexture();
 
-        colorAdd = radius / (dist * dist) * plane.Normal().Dot(dir);
+            pages = (packPage_t*)Mem_Realloc(pages, sizeof(packPage_t) * (numPages + 1), hb_static);
+            memset(&pages[p], 0, sizeof(packPage_t));
+            AddFreeRect(&pages[p], 0, 0, textureWidth, textureHeight);
+            numPages++;
 
-        for(j = 0; j < 3; j++) {
-            color[j] += (colorAdd * ((float)lInfo->rgba[j] / 255.0f)) * intensity;
-            if(color[j] > 1.0f) color[j] = 1.0f;
-            if(color[j] < 0.0f) color[j] = 0.0f;
+            if(!FindMaxRectsPosition(&pages[p], surface->lightmapDims[0],
+                surface->lightmapDims[1], &x, &y)) {
+                Error("Lightmap allocation failed\n");
+                return;
+            }
         }
 
-        tracedTexels++;
+        SplitMaxRects(&pages[p], x, y, surface->lightmapDims[0], surface->lightmapDims[1]);
+        PlaceSurface(surface, p, x, y);
+    }
+
+    for(p = 0; p < numPages; p++) {
+        Mem_Free(pages[p].freeRects);
     }
 
-    return color;
+    Mem_Free(pages);
+    Mem_Free(order);
 }
 
 //
-// kexLightmapBuilder::BuildSurfaceParams
+// kexLightmapBuilder::PackBlocks
 //
 
-void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface) {
-    kexPlane *plane;
-    kexBBox bounds;
-    kexVec3 roundedSize;
-    int i;
-    lightmapAxis_t axis;
-    kexVec3 tCoords[2];
-    kexVec3 tNormal;
-    kexVec3 tDelta;
-    kexVec3 tOrigin;
-    int width;
-    int height;
-    int x;
-    int y;
-    float d;
-
-    plane = &surface->plane;
-    bounds = GetBoundsFromSurface(surface);
+void kexLightmapBuilder::PackBlocks(void) {
+    surface_t *owner;
+    unsigned int i;
 
-    // round off dimentions
-    for(i = 0; i < 3; i++) {
-        bounds.min[i] = samples * kexMath::Floor(bounds.min[i] / samples);
-        bounds.max[i] = samples * kexMath::Ceil(bounds.max[i] / samples);
+    if(packer == LIGHTMAP_PACKER_MAXRECTS) {
+        PackMaxRects();
+    }
+    else {
+        for(i = 0; i < surfaces.Length(); i++) {
+            if(blockOwners && blockOwners[i] != (int)i) {
+                continue;
+            }
 
-        roundedSize[i] = (bounds.max[i] - bounds.min[i]) / samples + 1;
+            AllocateSkylineBlock(surfaces[i]);
+        }
     }
 
-    tCoords[0].Clear();
-    tCoords[1].Clear();
+    if(blockOwners == NULL) {
+        return;
+    }
+
+    // surfaces that share a block go wherever its owner went
+    for(i = 0; i < surfaces.Length(); i++) {
+        if(blockOwners[i] == (int)i) {
+            continue;
+        }
+
+        owner = surfaces[blockOwners[i]];
+        PlaceSurface(surfaces[i], owner->lightmapNum, owner->lightmapOffs[0], owner->lightmapOffs[1]);
+    }
+}
+
+//
+// kexLightmapBuilder::ResetPages
+//
+
+void kexLightmapBuilder::ResetPages(void) {
+    unsigned int i;
+
+    for(i = 0; i < textures.Length(); i++) {
+        Mem_Free(textures[i]);
+    }
+
+    textures.Empty();
+    numTextures = 0;
+    currentTexture = NULL;
+
+    if(allocBlocks) {
+        Mem_Free(allocBlocks);
+        allocBlocks = NULL;
+    }
+}
+
+//
+// CompareBlockAreas
+//
+// Largest blocks first so they become the owners. Ties keep surface order
+//
+
+static int CompareBlockAreas(const void *a, const void *b) {
+    surface_t *s1 = surfaces[*(const int*)a];
+    surface_t *s2 = surfaces[*(const int*)b];
+    int area1 = s1->lightmapDims[0] * s1->lightmapDims[1];
+    int area2 = s2->lightmapDims[0] * s2->lightmapDims[1];
+
+    if(area1 != area2) {
+        return area2 - area1;
+    }
+
+    return *(const int*)a - *(const int*)b;
+}
+
+//
+// kexLightmapBuilder::BlockFitsInside
+//
+// A surface can use another surface's block if it fits in it and
+// every one of its texels matches the texel in the same spot
+//
+
+bool kexLightmapBuilder::BlockFitsInside(const int surfaceNum, const int ownerNum) {
+    surface_t *surface = surfaces[surfaceNum];
+    surface_t *owner = surfaces[ownerNum];
+    byte *texels = surfaceTexels[surfaceNum];
+    byte *ownerTexels = surfaceTexels[ownerNum];
+    int rowSize;
+    int ownerRowSize;
+    int i;
+    int j;
+
+    if(surface->lightmapDims[0] > owner->lightmapDims[0] ||
+        surface->lightmapDims[1] > owner->lightmapDims[1]) {
+        return false;
+    }
+
+    rowSize = surface->lightmapDims[0] * 3;
+    ownerRowSize = owner->lightmapDims[0] * 3;
+
+    for(i = 0; i < surface->lightmapDims[1]; i++) {
+        for(j = 0; j < rowSize; j++) {
+            if(abs(texels[i * rowSize + j] - ownerTexels[i * ownerRowSize + j]) > dedupeTolerance) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+//
+// kexLightmapBuilder::DedupeBlocks
+//
+// Once everything is lit, surfaces whose texels are already somewhere in
+// the atlas point at that block instead of getting their own. The most
+// common case is unlit surfaces, which all come out the ambient color.
+// Owners are chained into buckets by HashBlock and a surface is only
+// compared against the owners in its own bucket
+//
+
+void kexLightmapBuilder::DedupeBlocks(void) {
+    int *order;
+    unsigned long long *hashes;
+    int *bucketHeads;
+    int *bucketNext;
+    int numBuckets;
+    int numShared;
+    int savedTexels;
+    int bucket;
+    int num;
+    int i;
+    int j;
+
+    blockOwners = (int*)Mem_Calloc(sizeof(int) * (surfaces.Length() + 1), hb_static);
+    order = (int*)Mem_Calloc(sizeof(int) * (surfaces.Length() + 1), hb_static);
+    hashes = (unsigned long long*)Mem_Calloc(sizeof(unsigned long long) *
+        (surfaces.Length() + 1), hb_static);
+    bucketNext = (int*)Mem_Calloc(sizeof(int) * (surfaces.Length() + 1), hb_static);
+
+    for(numBuckets = 1; numBuckets < (int)surfaces.Length(); numBuckets <<= 1);
+
+    bucketHeads = (int*)Mem_Malloc(sizeof(int) * numBuckets, hb_static);
+
+    for(i = 0; i < numBuckets; i++) {
+        bucketHeads[i] = -1;
+    }
+
+    for(i = 0; i < (int)surfaces.Length(); i++) {
+        order[i] = i;
+    }
+
+    qsort(order, surfaces.Length(), sizeof(int), CompareBlockAreas);
+
+    numShared = 0;
+    savedTexels = 0;
+
+    for(i = 0; i < (int)surfaces.Length(); i++) {
+        num = order[i];
+        blockOwners[num] = num;
+        hashes[num] = HashBlock(num);
+        bucket = (int)(hashes[num] & (numBuckets - 1));
+
+        for(j = bucketHeads[bucket]; j != -1; j = bucketNext[j]) {
+            if(hashes[j] == hashes[num] && BlockFitsInside(num, j)) {
+                blockOwners[num] = j;
+                break;
+            }
+        }
+
+        if(blockOwners[num] == num) {
+            bucketNext[num] = bucketHeads[bucket];
+            bucketHeads[bucket] = num;
+            continue;
+        }
+
+        numShared++;
+        savedTexels += surfaces[num]->lightmapDims[0] * surfaces[num]->lightmapDims[1];
+    }
+
+    Mem_Free(order);
+    Mem_Free(hashes);
+    Mem_Free(bucketHeads);
+    Mem_Free(bucketNext);
+
+    printf("Shared blocks: %i surfaces, %i texels saved\n", numShared, savedTexels);
+}
+
+//
+// kexLightmapBuilder::PrintPageUsage
+//
+
+void kexLightmapBuilder::PrintPageUsage(void) {
+    int *used;
+    int total;
+    int i;
+    unsigned int k;
+
+    used = (int*)Mem_Calloc(sizeof(int) * (numTextures + 1), hb_static);
+    total = 0;
+
+    for(k = 0; k < surfaces.Length(); k++) {
+        if(blockOwners && blockOwners[k] != (int)k) {
+            continue;
+        }
+
+        used[surfaces[k]->lightmapNum] += surfaces[k]->lightmapDims[0] * surfaces[k]->lightmapDims[1];
+    }
+
+    for(i = 0; i < numTextures; i++) {
+        printf("Page %i: %.1f%% used\n", i, 100.0f * used[i] / (textureWidth * textureHeight));
+        total += used[i];
+    }
+
+    printf("%i pages, %.1f%% used overall\n\n", numTextures,
+        100.0f * total / ((float)textureWidth * textureHeight * MAX(numTextures, 1)));
+
+    Mem_Free(used);
+}
+
+//
+// kexLightmapBuilder::GetBoundsFromSurface
+//
+
+kexBBox kexLightmapBuilder::GetBoundsFromSurface(const surface_t *surface) {
+    kexVec3 low(M_INFINITY, M_INFINITY, M_INFINITY);
+    kexVec3 hi(-M_INFINITY, -M_INFINITY, -M_INFINITY);
+
+    kexBBox bounds;
+    bounds.Clear();
+
+    for(int i = 0; i < surface->numVerts; i++) {
+        for(int j = 0; j < 3; j++) {
+            if(surface->verts[i][j] < low[j]) {
+                low[j] = surface->verts[i][j];
+            }
+            if(surface->verts[i][j] > hi[j]) {
+                hi[j] = surface->verts[i][j];
+            }
+        }
+    }
+
+    bounds.min = low;
+    bounds.max = hi;
+
+    return bounds;
+}
+
+//
+// kexLightmapBuilder::GetTexelBounds
+//
+// Bounds of every texel origin traced for the surface, including
+// the jittered origins of extra samples
+//
+
+kexBBox kexLightmapBuilder::GetTexelBounds(const surface_t *surface) {
+    kexBBox bounds;
+    kexVec3 corner;
+    kexVec3 steps[2];
+    float pad;
+    int i;
+    int j;
+
+    steps[0] = surface->lightmapSteps[0] * (float)(surface->lightmapDims[0] - 1);
+    steps[1] = surface->lightmapSteps[1] * (float)(surface->lightmapDims[1] - 1);
+
+    bounds.min = surface->lightmapOrigin + surface->plane.Normal();
+    bounds.max = bounds.min;
+
+    for(i = 1; i < 4; i++) {
+        corner = bounds.min;
+
+        if(i & 1) corner += steps[0];
+        if(i & 2) corner += steps[1];
+
+        for(j = 0; j < 3; j++) {
+            if(corner[j] < bounds.min[j]) bounds.min[j] = corner[j];
+            if(corner[j] > bounds.max[j]) bounds.max[j] = corner[j];
+        }
+    }
+
+    // extra samples land up to half a step to either side of the texel
+    if(extraSamples > 0) {
+        for(j = 0; j < 3; j++) {
+            pad = 0.5f * (kexMath::Fabs(surface->lightmapSteps[0][j]) +
+                          kexMath::Fabs(surface->lightmapSteps[1][j]));
+
+            bounds.min[j] -= pad;
+            bounds.max[j] += pad;
+        }
+    }
+
+    // leave room for rounding errors
+    bounds += 1.0f;
+    return bounds;
+}
+
+//
+// kexLightmapBuilder::GetSurfaceSectors
+//
+// Sectors a surface's texels can be in. Segs can be lit
+// from either side so they get both of their sectors
+//
+
+void kexLightmapBuilder::GetSurfaceSectors(const surface_t *surface, mapSector_t **sectors) {
+    mapSeg_t *seg;
+
+    sectors[0] = sectors[1] = NULL;
+
+    if(surface->type == ST_FLOOR || surface->type == ST_CEILING) {
+        sectors[0] = map->GetSectorFromSubSector(&map->mapSSects[surface->typeIndex]);
+    }
+    else if(surface->type != ST_UNKNOWN) {
+        seg = &map->mapSegs[surface->typeIndex];
+        sectors[0] = map->GetFrontSector(seg);
+        sectors[1] = map->GetBackSector(seg);
+    }
+}
+
+//
+// LightNumCompare
+//
+
+static int LightNumCompare(const void *a, const void *b) {
+    return *(const int*)a - *(const int*)b;
+}
+
+//
+// kexLightmapBuilder::BuildSurfaceLights
+//
+// Gives every surface the list of lights that can reach it. Point lights
+// come from the light grid and need a texel within their radius. Ceiling
+// lights have no radius so they are always kept. Lights behind the
+// surface's plane, or in a sector that the reject table says can't see
+// the surface's sectors, are dropped. Lists stay in light order so texels
+// add up their colors the same way as before
+//
+
+void kexLightmapBuilder::BuildSurfaceLights(void) {
+    surface_t *surface;
+    mapThing_t *light;
+    kexBBox bounds;
+    kexVec3 lightOrigin;
+    kexVec3 delta;
+    int *stamps;
+    int *list;
+    mapSector_t **lightSectors;
+    mapSector_t *sectors[2];
+    mapSubSector_t *sub;
+    int numRejected;
+    int cellMin[2];
+    int cellMax[2];
+    int count;
+    int facing;
+    int total;
+    int maxTotal;
+    int x;
+    int y;
+    int j;
+    int k;
+    float radius;
+    unsigned int i;
+    unsigned int l;
+
+    surfaceLights = (lightList_t*)Mem_Calloc(sizeof(lightList_t) * surfaces.Length(), hb_static);
+    stamps = (int*)Mem_Calloc(sizeof(int) * (thingLights.Length() + 1), hb_static);
+    list = (int*)Mem_Calloc(sizeof(int) * (thingLights.Length() + 1), hb_static);
+
+    lightSectors = (mapSector_t**)Mem_Calloc(sizeof(mapSector_t*) *
+        (thingLights.Length() + 1), hb_static);
+
+    for(l = 0; l < thingLights.Length(); l++) {
+        if((sub = map->PointInSubSector(thingLights[l]->x, thingLights[l]->y))) {
+            lightSectors[l] = map->GetSectorFromSubSector(sub);
+        }
+    }
+
+    maxTotal = 1024;
+    surfaceLightNums = (int*)Mem_Calloc(sizeof(int) * maxTotal, hb_static);
+    total = 0;
+    numRejected = 0;
+
+    for(i = 0; i < surfaces.Length(); i++) {
+        surface = surfaces[i];
+        bounds = GetTexelBounds(surface);
+        GetSurfaceSectors(surface, sectors);
+        count = 0;
+
+        for(j = 0; j < 2; j++) {
+            cellMin[j] = (int)((bounds.min[j] - lightGridOrigin[j]) / lightGridCellSize);
+            cellMax[j] = (int)((bounds.max[j] - lightGridOrigin[j]) / lightGridCellSize);
+
+            if(cellMin[j] < 0) cellMin[j] = 0;
+            if(cellMax[j] >= lightGridSize[j]) cellMax[j] = lightGridSize[j] - 1;
+        }
+
+        for(y = cellMin[1]; y <= cellMax[1]; y++) {
+            for(x = cellMin[0]; x <= cellMax[0]; x++) {
+                lightList_t *cell = &lightGrid[y * lightGridSize[0] + x];
+
+                for(k = 0; k < cell->count; k++) {
+                    int num = lightGridLights[cell->first + k];
+
+                    // stamps start out as zero, so offset the surface number by one
+                    if(stamps[num] != (int)i + 1) {
+                        stamps[num] = i + 1;
+                        list[count++] = num;
+                    }
+                }
+            }
+        }
+
+        for(l = 0; l < thingLights.Length(); l++) {
+            if(thingLights[l]->type == TYPE_DIRECTIONAL_CEILING) {
+                list[count++] = l;
+            }
+        }
+
+        qsort(list, count, sizeof(int), LightNumCompare);
+
+        surfaceLights[i].first = total;
+        surfaceLights[i].count = 0;
+
+        for(k = 0; k < count; k++) {
+            light = thingLights[list[k]];
+            lightOrigin.Set(F(light->x << 16), F(light->y << 16), F(light->z << 16));
+
+            if(surface->plane.Distance(lightOrigin) - surface->plane.d < 0) {
+                continue;
+            }
+
+            if(!map->CheckSectorVisibility(lightSectors[list[k]], sectors[0]) &&
+                (sectors[1] == NULL ||
+                !map->CheckSectorVisibility(lightSectors[list[k]], sectors[1]))) {
+                    numRejected++;
+                    continue;
+            }
+
+            if(light->type != TYPE_DIRECTIONAL_CEILING) {
+                radius = 50.0f * light->angle;
+
+                // distance from the light to the closest point of the bounds
+                for(j = 0; j < 3; j++) {
+                    if(lightOrigin[j] < bounds.min[j]) {
+                        delta[j] = bounds.min[j] - lightOrigin[j];
+                    }
+                    else if(lightOrigin[j] > bounds.max[j]) {
+                        delta[j] = lightOrigin[j] - bounds.max[j];
+                    }
+                    else {
+                        delta[j] = 0;
+                    }
+                }
+
+                if(delta.UnitSq() > radius * radius) {
+                    continue;
+                }
+            }
+
+            if(total == maxTotal) {
+                maxTotal <<= 1;
+                surfaceLightNums = (int*)Mem_Realloc(surfaceLightNums,
+                    sizeof(int) * maxTotal, hb_static);
+            }
+
+            surfaceLightNums[total++] = list[k];
+            surfaceLights[i].count++;
+        }
+
+        // every light in front of the surface used to be traced for every texel
+        facing = 0;
+
+        for(l = 0; l < thingLights.Length(); l++) {
+            light = thingLights[l];
+            lightOrigin.Set(F(light->x << 16), F(light->y << 16), F(light->z << 16));
+
+            if(surface->plane.Distance(lightOrigin) - surface->plane.d >= 0) {
+                facing++;
+            }
+        }
+
+        culledTraces += (long long)(facing - surfaceLights[i].count) *
+            surface->lightmapDims[0] * surface->lightmapDims[1];
+    }
+
+    Mem_Free(stamps);
+    Mem_Free(list);
+    Mem_Free(lightSectors);
+
+    printf("Surface lights: %i, %i hidden by reject\n", total, numRejected);
+}
+
+//
+// HashData
+//
+// 64 bit FNV-1a, good enough to tell bake inputs apart
+//
+
+static unsigned long long HashData(unsigned long long hash, const void *data, const int size) {
+    const byte *b = (const byte*)data;
+
+    for(int i = 0; i < size; i++) {
+        hash ^= b[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static unsigned long long HashInt(unsigned long long hash, const int val) {
+    return HashData(hash, &val, sizeof(int));
+}
+
+static unsigned long long HashFloat(unsigned long long hash, const float val) {
+    return HashData(hash, &val, sizeof(float));
+}
+
+static unsigned long long HashVector(unsigned long long hash, const kexVec3 &vec) {
+    hash = HashFloat(hash, vec.x);
+    hash = HashFloat(hash, vec.y);
+    return HashFloat(hash, vec.z);
+}
+
+//
+// CompareCacheEntries
+//
+
+static int CompareCacheEntries(const void *a, const void *b) {
+    unsigned long long k1 = ((const lightmapCacheEntry_t*)a)->key;
+    unsigned long long k2 = ((const lightmapCacheEntry_t*)b)->key;
+
+    if(k1 < k2) return -1;
+    if(k1 > k2) return 1;
+    return 0;
+}
+
+//
+// kexLightmapBuilder::HashSurfaceGeometry
+//
+
+unsigned long long kexLightmapBuilder::HashSurfaceGeometry(unsigned long long hash,
+                                                           const surface_t *surface) {
+    mapSector_t *sector;
+    int i;
+
+    hash = HashInt(hash, surface->type);
+    hash = HashInt(hash, surface->numVerts);
+
+    for(i = 0; i < surface->numVerts; i++) {
+        hash = HashVector(hash, surface->verts[i]);
+    }
+
+    // sun light only counts ceilings that belong to the light's own sector
+    if(surface->type == ST_CEILING) {
+        sector = map->GetSectorFromSubSector(&map->mapSSects[surface->typeIndex]);
+        hash = HashInt(hash, sector ? sector - map->mapSectors : -1);
+    }
+
+    return hash;
+}
+
+//
+// kexLightmapBuilder::HashBlock
+//
+// Hashes a block's size and texels, with every channel divided down by
+// the dedupe tolerance so blocks that are close enough to share mostly
+// hash the same (with no tolerance the match is exact). Blocks of a
+// single color only hash that color, since they fit inside any larger
+// block of the same color
+//
+
+unsigned long long kexLightmapBuilder::HashBlock(const int surfaceNum) {
+    surface_t *surface = surfaces[surfaceNum];
+    byte *texels = surfaceTexels[surfaceNum];
+    unsigned long long hash;
+    int step;
+    int count;
+    int i;
+
+    step = dedupeTolerance + 1;
+    count = surface->lightmapDims[0] * surface->lightmapDims[1] * 3;
+    hash = LIGHTMAP_CACHE_SEED;
+
+    for(i = 3; i < count; i++) {
+        if(texels[i] / step != texels[i % 3] / step) {
+            break;
+        }
+    }
+
+    if(count != 0 && i == count) {
+        hash = HashInt(hash, -1);
+
+        for(i = 0; i < 3; i++) {
+            hash = HashInt(hash, texels[i] / step);
+        }
+
+        return hash;
+    }
+
+    hash = HashInt(hash, surface->lightmapDims[0]);
+    hash = HashInt(hash, surface->lightmapDims[1]);
+
+    for(i = 0; i < count; i++) {
+        hash = HashInt(hash, texels[i] / step);
+    }
+
+    return hash;
+}
+
+//
+// kexLightmapBuilder::BuildSurfaceKeys
+//
+// A surface's texels only depend on where its texels are, the lights
+// in its list and whatever geometry can cast a shadow from those lights.
+// Point light shadow rays never leave the light's radius, but ceiling
+// lights trace across the whole map so they take in all of the geometry
+//
+
+void kexLightmapBuilder::BuildSurfaceKeys(void) {
+    unsigned long long *lightKeys;
+    unsigned long long mapKey;
+    unsigned long long key;
+    mapThing_t *light;
+    kexBBox *bounds;
+    kexBBox lightBounds;
+    kexVec3 lightOrigin;
+    surface_t *surface;
+    float radius;
+    int color;
+    int i;
+    unsigned int j;
+    unsigned int k;
+
+    surfaceKeys = (unsigned long long*)Mem_Calloc(sizeof(unsigned long long) *
+        (surfaces.Length() + 1), hb_static);
+    lightKeys = (unsigned long long*)Mem_Calloc(sizeof(unsigned long long) *
+        (thingLights.Length() + 1), hb_static);
+    bounds = new kexBBox[surfaces.Length() + 1];
+
+    mapKey = LIGHTMAP_CACHE_SEED;
+
+    for(j = 0; j < surfaces.Length(); j++) {
+        bounds[j] = GetBoundsFromSurface(surfaces[j]);
+        mapKey = HashSurfaceGeometry(mapKey, surfaces[j]);
+    }
+
+    for(k = 0; k < thingLights.Length(); k++) {
+        light = thingLights[k];
+        key = LIGHTMAP_CACHE_SEED;
+
+        key = HashInt(key, light->type);
+        key = HashInt(key, light->x);
+        key = HashInt(key, light->y);
+        key = HashInt(key, light->z);
+        key = HashInt(key, light->angle);
+
+        if(light->options <= 255) {
+            color = light->options | (light->options << 8) | (light->options << 16);
+        }
+        else {
+            byte *rgba = lightInfos[light->options - 256].rgba;
+            color = rgba[0] | (rgba[1] << 8) | (rgba[2] << 16);
+        }
+
+        key = HashInt(key, color);
+
+        if(light->type == TYPE_DIRECTIONAL_CEILING) {
+            key = HashInt(key, ceilingLights[k].surface != NULL);
+            key = HashInt(key, ceilingLights[k].sector ?
+                ceilingLights[k].sector - map->mapSectors : -1);
+            key = HashVector(key, ceilingLights[k].dir);
+            key = HashData(key, &mapKey, sizeof(mapKey));
+        }
+        else {
+            lightOrigin.Set(F(light->x << 16), F(light->y << 16), F(light->z << 16));
+            radius = 50.0f * light->angle + 1.0f;
+            lightBounds = kexBBox(lightOrigin, lightOrigin) + radius;
+
+            for(j = 0; j < surfaces.Length(); j++) {
+                if(bounds[j].IntersectingBox(lightBounds)) {
+                    key = HashSurfaceGeometry(key, surfaces[j]);
+                }
+            }
+        }
+
+        lightKeys[k] = key;
+    }
+
+    for(j = 0; j < surfaces.Length(); j++) {
+        surface = surfaces[j];
+        key = LIGHTMAP_CACHE_SEED;
+
+        // ambience is added once per light in the whole map
+        key = HashFloat(key, ambience);
+        key = HashFloat(key, adaptiveThreshold);
+        key = HashInt(key, extraSamples);
+        key = HashInt(key, thingLights.Length());
+
+        key = HashVector(key, surface->plane.Normal());
+        key = HashInt(key, surface->lightmapDims[0]);
+        key = HashInt(key, surface->lightmapDims[1]);
+        key = HashVector(key, surface->lightmapOrigin);
+        key = HashVector(key, surface->lightmapSteps[0]);
+        key = HashVector(key, surface->lightmapSteps[1]);
+
+        for(i = 0; i < surfaceLights[j].count; i++) {
+            key = HashData(key, &lightKeys[surfaceLightNums[surfaceLights[j].first + i]],
+                sizeof(unsigned long long));
+        }
+
+        surfaceKeys[j] = key;
+    }
+
+    delete[] bounds;
+    Mem_Free(lightKeys);
+}
+
+//
+// kexLightmapBuilder::LoadCache
+//
+
+void kexLightmapBuilder::LoadCache(void) {
+    kexBinFile cache;
+    lightmapCacheEntry_t *entry;
+    int length;
+    int count;
+    int left;
+    int i;
+
+    numCacheEntries = 0;
+
+    if(!cache.Open(cacheFile)) {
+        printf("No lightmap cache found, baking every surface\n");
+        return;
+    }
+
+    length = cache.Length();
+
+    if(length < 12 ||
+       cache.Read32() != LIGHTMAP_CACHE_ID || cache.Read32() != LIGHTMAP_CACHE_VERSION) {
+        printf("Lightmap cache %s is out of date, ignoring it\n", cacheFile);
+        return;
+    }
+
+    count = cache.Read32();
+
+    // every entry takes at least its 16 byte header
+    if(count < 0 || count > (length - 12) / 16) {
+        printf("Lightmap cache %s is corrupt, ignoring it\n", cacheFile);
+        return;
+    }
+
+    cacheEntries = (lightmapCacheEntry_t*)Mem_Calloc(sizeof(lightmapCacheEntry_t) *
+        (count + 1), hb_static);
+
+    for(i = 0; i < count; i++) {
+        entry = &cacheEntries[i];
+        left = length - (cache.BufferAt() - cache.Buffer());
+
+        if(left < 16) {
+            break;
+        }
+
+        entry->key = (unsigned int)cache.Read32();
+        entry->key |= (unsigned long long)(unsigned int)cache.Read32() << 32;
+        entry->width = cache.Read32();
+        entry->height = cache.Read32();
+        entry->texels = cache.BufferAt();
+
+        if(entry->width < 0 || entry->height < 0 ||
+           (long long)entry->width * entry->height * 3 > left - 16) {
+            break;
+        }
+
+        cache.SetOffset((cache.BufferAt() - cache.Buffer()) + entry->width * entry->height * 3);
+    }
+
+    // a truncated or damaged file, bake everything again
+    if(i != count) {
+        Mem_Free(cacheEntries);
+        cacheEntries = NULL;
+
+        printf("Lightmap cache %s is corrupt, ignoring it\n", cacheFile);
+        return;
+    }
+
+    numCacheEntries = count;
+
+    qsort(cacheEntries, numCacheEntries, sizeof(lightmapCacheEntry_t), CompareCacheEntries);
+
+    // the texels point into the file buffer, so keep it around
+    cache.SetBuffer(NULL);
+
+    printf("Loaded %i surfaces from lightmap cache %s\n", numCacheEntries, cacheFile);
+}
+
+//
+// kexLightmapBuilder::SaveCache
+//
+
+void kexLightmapBuilder::SaveCache(void) {
+    kexBinFile cache;
+    surface_t *surface;
+    unsigned int k;
+
+    if(!cache.Create(cacheFile)) {
+        printf("Couldn't write lightmap cache %s\n", cacheFile);
+        return;
+    }
+
+    cache.Write32(LIGHTMAP_CACHE_ID);
+    cache.Write32(LIGHTMAP_CACHE_VERSION);
+    cache.Write32(surfaces.Length());
+
+    for(k = 0; k < surfaces.Length(); k++) {
+        surface = surfaces[k];
+
+        cache.Write32((int)(surfaceKeys[k] & 0xffffffff));
+        cache.Write32((int)(surfaceKeys[k] >> 32));
+        cache.Write32(surface->lightmapDims[0]);
+        cache.Write32(surface->lightmapDims[1]);
+
+        cache.WriteBytes(surfaceTexels[k], surface->lightmapDims[0] * surface->lightmapDims[1] * 3);
+    }
+
+    cache.Close();
+}
+
+//
+// kexLightmapBuilder::RestoreSurface
+//
+// Copies the texels of a surface from the last bake if nothing
+// that lights it has changed since
+//
+
+bool kexLightmapBuilder::RestoreSurface(surface_t *surface, const unsigned long long key,
+                                        byte *texels) {
+    lightmapCacheEntry_t search;
+    lightmapCacheEntry_t *entry;
+
+    if(numCacheEntries <= 0) {
+        return false;
+    }
+
+    search.key = key;
+    entry = (lightmapCacheEntry_t*)bsearch(&search, cacheEntries, numCacheEntries,
+        sizeof(lightmapCacheEntry_t), CompareCacheEntries);
+
+    if(entry == NULL ||
+        entry->width != surface->lightmapDims[0] ||
+        entry->height != surface->lightmapDims[1]) {
+        return false;
+    }
+
+    memcpy(texels, entry->texels, entry->width * entry->height * 3);
+    return true;
+}
+
+//
+// kexLightmapBuilder::SetupCeilingLights
+//
+// Everything EmitFromCeiling needs to know about a light
+// stays the same for every texel, so look it up only once
+//
+
+void kexLightmapBuilder::SetupCeilingLights(kexDoomMap &doomMap) {
+    mapThing_t *light;
+    mapThing_t *thing;
+    mapSubSector_t *sub;
+    ceilingLight_t *ceiling;
+    unsigned int i;
+    int j;
+
+    ceilingLights = (ceilingLight_t*)Mem_Calloc(sizeof(ceilingLight_t) *
+        (thingLights.Length() + 1), hb_static);
+
+    for(i = 0; i < thingLights.Length(); i++) {
+        light = thingLights[i];
+        ceiling = &ceilingLights[i];
+
+        if(light->type != TYPE_DIRECTIONAL_CEILING) {
+            continue;
+        }
+
+        if(!(sub = doomMap.PointInSubSector(light->x, light->y))) {
+            continue;
+        }
+        if(!(ceiling->sector = doomMap.GetSectorFromSubSector(sub))) {
+            continue;
+        }
+
+        ceiling->surface = doomMap.leafSurfaces[1][sub - doomMap.mapSSects];
+        ceiling->dir = kexVec3(0, 0, 1);
+
+        for(j = 0; j < doomMap.numThings; j++) {
+            thing = &doomMap.mapThings[j];
+
+            if(thing->type != TYPE_DIRECTIONAL_TARGET) {
+                continue;
+            }
+
+            if(thing->tid != light->tid) {
+                continue;
+            }
+
+            ceiling->dir = kexVec3(F(light->x << 16), F(light->y << 16), F(light->z << 16)) -
+                kexVec3(F(thing->x << 16), F(thing->y << 16), F(thing->z << 16));
+
+            ceiling->dir.Normalize();
+            break;
+        }
+    }
+}
+
+//
+// kexLightmapBuilder::EmitFromCeiling
+//
+
+bool kexLightmapBuilder::EmitFromCeiling(const kexVec3 &origin, const kexVec3 &normal,
+                                         const ceilingLight_t *ceiling, float *dist) {
+    traceResult_t result;
+    mapSubSector_t *tSub;
+
+    if(ceiling->surface == NULL) {
+        return false;
+    }
+
+    *dist = normal.Dot(ceiling->dir);
+
+    if(*dist <= 0) {
+        return false;
+    }
+
+    result = trace.TraceRay(origin, origin + (ceiling->dir * 32768));
+
+    if(result.fraction == 1 || result.hitSurface == NULL) {
+        return false;
+    }
+
+    if(result.hitSurface->type != ST_CEILING) {
+        return false;
+    }
+
+    tSub = &map->mapSSects[result.hitSurface->typeIndex];
+
+    if(map->GetSectorFromSubSector(tSub) != ceiling->sector ||
+        result.hitSurface->type != ST_CEILING) {
+            return false;
+    }
+
+    return true;
+}
+
+//
+// kexLightmapBuilder::LightTexelSamples
+//
+// Lights a row of up to TRACE_PACKET_MAX texels at once, so the
+// shadow rays from each point light can be traced as a packet
+//
+
+void kexLightmapBuilder::LightTexelSamples(lightmapThread_t *thread, const lightList_t *lights,
+                                           const kexVec3 *origins, const int count,
+                                           kexPlane &plane, kexVec3 *colors,
+                                           unsigned int *shadows) {
+    mapThing_t *light;
+    kexVec3 lightOrigin;
+    kexVec3 dir;
+    int i;
+    int j;
+    int k;
+    int m;
+    int n;
+    int num;
+    float dist;
+    float radius;
+    float intensity;
+    float colorAdd;
+    mapLightInfo_t *lInfo;
+    mapLightInfo_t lInfo2;
+    kexVec3 inRange[TRACE_PACKET_MAX];
+    int texels[TRACE_PACKET_MAX];
+    bool blocked[TRACE_PACKET_MAX];
+
+    for(k = 0; k < count; k++) {
+        colors[k].Clear();
+
+        if(shadows) {
+            shadows[k] = 2166136261U;
+        }
+    }
+
+    if(ambience > 0.0f) {
+        // ambience has always been added once for every light in the map
+        for(i = 0; i < (int)thingLights.Length(); i++) {
+            for(k = 0; k < count; k++) {
+                for(j = 0; j < 3; j++) {
+                    colors[k][j] += ambience;
+                    if(colors[k][j] > 1.0f) colors[k][j] = 1.0f;
+                    if(colors[k][j] < 0.0f) colors[k][j] = 0.0f;
+                }
+            }
+        }
+    }
+
+    // lights behind the plane are already left out of the list
+    for(i = 0; i < lights->count; i++) {
+        num = surfaceLightNums[lights->first + i];
+        light = thingLights[num];
+        lightOrigin.Set(F(light->x << 16), F(light->y << 16), F(light->z << 16));
+
+        radius = 50.0f * light->angle;
+
+        if(light->options <= 255) {
+            lInfo2.rgba[0] = (byte)light->options;
+            lInfo2.rgba[1] = (byte)light->options;
+            lInfo2.rgba[2] = (byte)light->options;
+            lInfo2.rgba[3] = 0;
+            lInfo2.tag = 0;
+        }
+        else {
+            lInfo2 = lightInfos[light->options - 256];
+        }
+
+        lInfo = &lInfo2;
+
+        //intensity = lInfo->rgba[3];
+        intensity = 8;
+
+        if(intensity < 1.0f) {
+            intensity = 1.0f;
+        }
+
+        if(light->type == TYPE_DIRECTIONAL_CEILING) {
+            for(k = 0; k < count; k++) {
+                if(!EmitFromCeiling(origins[k], plane.Normal(), &ceilingLights[num], &dist)) {
+                    continue;
+                }
+
+                if(shadows) {
+                    shadows[k] = (shadows[k] ^ num) * 16777619U;
+                }
+
+                for(j = 0; j < 3; j++) {
+                    colors[k][j] += (/*dist **/ ((float)lInfo->rgba[j] / 255.0f));
+                    if(colors[k][j] > 1.0f) colors[k][j] = 1.0f;
+                    if(colors[k][j] < 0.0f) colors[k][j] = 0.0f;
+                }
+
+                thread->tracedTexels++;
+            }
+            continue;
+        }
+
+        n = 0;
+
+        // only trace the texels that are within reach of the light
+        for(k = 0; k < count; k++) {
+            if(origins[k].DistanceSq(lightOrigin) > radius * radius) {
+                thread->culledTraces++;
+                continue;
+            }
+
+            inRange[n] = origins[k];
+            texels[n++] = k;
+        }
+
+        trace.TraceOcclusionPacket(lightOrigin, inRange, n, blocked);
+
+        for(m = 0; m < n; m++) {
+            if(blocked[m]) {
+                continue;
+            }
+
+            k = texels[m];
+
+            if(shadows) {
+                shadows[k] = (shadows[k] ^ num) * 16777619U;
+            }
+
+            dir = (lightOrigin - origins[k]);
+            dist = dir.Unit();
+
+            if(light->type == TYPE_LIGHTPOINT_WEAK) {
+                if(dist < 128) {
+                    dist = 128;
+                }
+            }
+
+            dir.Normalize();
+
+            colorAdd = radius / (dist * dist) * plane.Normal().Dot(dir);
+
+            for(j = 0; j < 3; j++) {
+                colors[k][j] += (colorAdd * ((float)lInfo->rgba[j] / 255.0f)) * intensity;
+                if(colors[k][j] > 1.0f) colors[k][j] = 1.0f;
+                if(colors[k][j] < 0.0f) colors[k][j] = 0.0f;
+            }
+
+            thread->tracedTexels++;
+        }
+    }
+}
+
+//
+// kexLightmapBuilder::BuildSurfaceParams
+//
+
+void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface) {
+    kexPlane *plane;
+    kexBBox bounds;
+    kexVec3 roundedSize;
+    int i;
+    lightmapAxis_t axis;
+    kexVec3 tCoords[2];
+    kexVec3 tNormal;
+    kexVec3 tDelta;
+    kexVec3 tOrigin;
+    int width;
+    int height;
+    float d;
+
+    plane = &surface->plane;
+    bounds = GetBoundsFromSurface(surface);
+
+    // round off dimentions
+    for(i = 0; i < 3; i++) {
+        bounds.min[i] = samples * kexMath::Floor(bounds.min[i] / samples);
+        bounds.max[i] = samples * kexMath::Ceil(bounds.max[i] / samples);
+
+        roundedSize[i] = (bounds.max[i] - bounds.min[i]) / samples + 1;
+    }
+
+    tCoords[0].Clear();
+    tCoords[1].Clear();
 
     tNormal.Set(
         kexMath::Fabs(plane->a),
@@ -472,130 +1808,682 @@ void kexLightmapBuilder::BuildSurfaceParams(surface_t *surface) {
         height = textureHeight;
     }
 
-    // make room for new lightmap block
-    if(!MakeRoomForBlock(width, height, &x, &y)) {
-        NewTexture();
-        if(!MakeRoomForBlock(width, height, &x, &y)) {
-            Error("Lightmap allocation failed\n");
-            return;
+    surface->lightmapCoords = (float*)Mem_Calloc(sizeof(float) *
+        surface->numVerts * 2, hb_map);
+
+    // texel coordinates within the block, PlaceSurface moves
+    // them into the page once the block has been allocated
+    for(i = 0; i < surface->numVerts; i++) {
+        tDelta = surface->verts[i] - bounds.min;
+        surface->lightmapCoords[i * 2 + 0] = tDelta.Dot(tCoords[0]);
+        surface->lightmapCoords[i * 2 + 1] = tDelta.Dot(tCoords[1]);
+    }
+
+    tOrigin = bounds.min;
+
+    // project tOrigin and tCoords so they lie on the plane
+    d = (plane->Distance(bounds.min) - plane->d) / plane->Normal()[axis];
+    tOrigin[axis] -= d;
+
+    for(i = 0; i < 2; i++) {
+        tCoords[i].Normalize();
+        d = plane->Distance(tCoords[i]) / plane->Normal()[axis];
+        tCoords[i][axis] -= d;
+    }
+
+    surface->lightmapDims[0] = width;
+    surface->lightmapDims[1] = height;
+    surface->lightmapOrigin = tOrigin;
+    surface->lightmapSteps[0] = tCoords[0] * (float)samples;
+    surface->lightmapSteps[1] = tCoords[1] * (float)samples;
+}
+
+//
+// NextCoarseTexel
+//
+// Steps along the coarse grid, always ending on the last texel
+//
+
+static int NextCoarseTexel(const int texel, const int size) {
+    if(texel == size - 1) {
+        return size;
+    }
+
+    return MIN(texel + LIGHTMAP_ADAPTIVE_STEP, size - 1);
+}
+
+//
+// kexLightmapBuilder::TexelOrigin
+//
+
+kexVec3 kexLightmapBuilder::TexelOrigin(const surface_t *surface, const int x, const int y) {
+    return surface->lightmapOrigin + surface->plane.Normal() +
+        (surface->lightmapSteps[0] * (float)x) +
+        (surface->lightmapSteps[1] * (float)y);
+}
+
+//
+// kexLightmapBuilder::BlockCrossesLightRange
+//
+// True if the edge of a point light's radius might pass through the
+// block, in which case the corners alone can't tell how it is lit
+//
+
+bool kexLightmapBuilder::BlockCrossesLightRange(const surface_t *surface, const lightList_t *lights,
+                                                const int x0, const int y0,
+                                                const int x1, const int y1) {
+    mapThing_t *light;
+    kexVec3 center;
+    kexVec3 lightOrigin;
+    float extent;
+    float radius;
+    float dist;
+    int i;
+
+    center = (TexelOrigin(surface, x0, y0) + TexelOrigin(surface, x1, y1)) * 0.5f;
+    extent = MAX(center.Distance(TexelOrigin(surface, x0, y0)),
+                 center.Distance(TexelOrigin(surface, x1, y0)));
+
+    for(i = 0; i < lights->count; i++) {
+        light = thingLights[surfaceLightNums[lights->first + i]];
+
+        if(light->type == TYPE_DIRECTIONAL_CEILING) {
+            continue;
+        }
+
+        lightOrigin.Set(F(light->x << 16), F(light->y << 16), F(light->z << 16));
+        radius = 50.0f * light->angle;
+        dist = center.Distance(lightOrigin);
+
+        if(dist + extent >= radius && dist - extent <= radius) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+//
+// kexLightmapBuilder::BuildSamplePattern
+//
+// N-rooks pattern of texel offsets for supersampling: each sample gets
+// its own row and column of a grid over the texel, jittered within it.
+// It comes from a fixed seed and is shared by every texel, so builds
+// don't depend on the thread count
+//
+
+void kexLightmapBuilder::BuildSamplePattern(void) {
+    int columns[LIGHTMAP_MAX_SAMPLES];
+    int numSamples;
+    int tmp;
+    int i;
+    int j;
+
+    numSamples = extraSamples + 1;
+
+    kexRand::SetSeed(LIGHTMAP_SAMPLE_SEED);
+
+    for(i = 0; i < numSamples; i++) {
+        columns[i] = i;
+    }
+
+    for(i = numSamples - 1; i > 0; i--) {
+        j = kexRand::Max(i + 1);
+        tmp = columns[i];
+        columns[i] = columns[j];
+        columns[j] = tmp;
+    }
+
+    for(i = 0; i < numSamples; i++) {
+        samplePattern[i][0] = ((float)i + kexRand::Float()) / (float)numSamples - 0.5f;
+        samplePattern[i][1] = ((float)columns[i] + kexRand::Float()) / (float)numSamples - 0.5f;
+    }
+}
+
+//
+// kexLightmapBuilder::LightTexels
+//
+// Lights up to TRACE_PACKET_MAX texels, averaging extraSamples + 1
+// samples across each one. The samples of a texel are kept next
+// to each other so they end up in the same packets
+//
+
+void kexLightmapBuilder::LightTexels(surface_t *surface, const lightList_t *lights,
+                                     lightmapThread_t *thread, const int *texels,
+                                     const int count, kexVec3 *colors, unsigned int *shadows) {
+    kexVec3 pos[TRACE_PACKET_MAX * LIGHTMAP_MAX_SAMPLES];
+    kexVec3 sampleColors[TRACE_PACKET_MAX];
+    unsigned int sampleShadows[TRACE_PACKET_MAX];
+    kexVec3 origin;
+    int sampleWidth;
+    int numSamples;
+    int total;
+    int batch;
+    int i;
+    int k;
+    int t;
+
+    sampleWidth = surface->lightmapDims[0];
+
+    if(extraSamples <= 0) {
+        for(k = 0; k < count; k++) {
+            pos[k] = TexelOrigin(surface, texels[k] % sampleWidth, texels[k] / sampleWidth);
+        }
+
+        LightTexelSamples(thread, lights, pos, count, surface->plane, colors, shadows);
+        return;
+    }
+
+    numSamples = extraSamples + 1;
+    total = 0;
+
+    for(k = 0; k < count; k++) {
+        origin = TexelOrigin(surface, texels[k] % sampleWidth, texels[k] / sampleWidth);
+        colors[k].Clear();
+
+        if(shadows) {
+            shadows[k] = 2166136261U;
+        }
+
+        for(i = 0; i < numSamples; i++) {
+            pos[total++] = origin +
+                (surface->lightmapSteps[0] * samplePattern[i][0]) +
+                (surface->lightmapSteps[1] * samplePattern[i][1]);
+        }
+    }
+
+    for(i = 0; i < total; i += batch) {
+        batch = MIN(TRACE_PACKET_MAX, total - i);
+
+        LightTexelSamples(thread, lights, &pos[i], batch, surface->plane, sampleColors,
+            shadows ? sampleShadows : NULL);
+
+        for(k = 0; k < batch; k++) {
+            t = (i + k) / numSamples;
+            colors[t] += sampleColors[k];
+
+            if(shadows) {
+                shadows[t] = (shadows[t] ^ sampleShadows[k]) * 16777619U;
+            }
+        }
+    }
+
+    for(k = 0; k < count; k++) {
+        colors[k] *= (1.0f / (float)numSamples);
+    }
+}
+
+//
+// kexLightmapBuilder::SampleTexels
+//
+
+void kexLightmapBuilder::SampleTexels(surface_t *surface, const lightList_t *lights,
+                                      lightmapThread_t *thread, const int *texels,
+                                      const int count) {
+    kexVec3 colors[TRACE_PACKET_MAX];
+    unsigned int shadows[TRACE_PACKET_MAX];
+    int k;
+
+    LightTexels(surface, lights, thread, texels, count, colors, shadows);
+
+    for(k = 0; k < count; k++) {
+        thread->colorSamples[texels[k]] = colors[k];
+        thread->texelShadows[texels[k]] = shadows[k];
+        thread->texelSampled[texels[k]] = 1;
+    }
+}
+
+//
+// kexLightmapBuilder::QueueTexel
+//
+
+void kexLightmapBuilder::QueueTexel(surface_t *surface, const lightList_t *lights,
+                                    lightmapThread_t *thread, int *batch, int *count,
+                                    const int texel) {
+    if(thread->texelSampled[texel]) {
+        return;
+    }
+
+    // keep it from being queued twice before the batch is traced
+    thread->texelSampled[texel] = 1;
+    batch[(*count)++] = texel;
+
+    if(*count == TRACE_PACKET_MAX) {
+        SampleTexels(surface, lights, thread, batch, *count);
+        *count = 0;
+    }
+}
+
+//
+// kexLightmapBuilder::TraceSurfaceAdaptive
+//
+// Traces every LIGHTMAP_ADAPTIVE_STEP texels first. Blocks between those
+// whose corners are lit by the same lights, are close enough in color and
+// aren't cut by the edge of a light's radius are filled in bilinearly,
+// the rest are traced texel by texel
+//
+
+void kexLightmapBuilder::TraceSurfaceAdaptive(surface_t *surface, const lightList_t *lights,
+                                              lightmapThread_t *thread) {
+    kexVec3 *colorSamples = thread->colorSamples;
+    unsigned int *shadows = thread->texelShadows;
+    int coarse[2][LIGHTMAP_MAX_SIZE / LIGHTMAP_ADAPTIVE_STEP + 2];
+    int numCoarse[2];
+    int corners[4];
+    int batch[TRACE_PACKET_MAX];
+    int count;
+    int sampleWidth;
+    int sampleHeight;
+    int pass;
+    int bx;
+    int by;
+    int x0;
+    int x1;
+    int y0;
+    int y1;
+    int x;
+    int y;
+    int i;
+    int j;
+    float lo;
+    float hi;
+    float fx;
+    float fy;
+    bool smooth;
+
+    sampleWidth = surface->lightmapDims[0];
+    sampleHeight = surface->lightmapDims[1];
+
+    memset(thread->texelSampled, 0, sampleWidth * sampleHeight);
+
+    numCoarse[0] = numCoarse[1] = 0;
+
+    for(x = 0; x < sampleWidth; x = NextCoarseTexel(x, sampleWidth)) {
+        coarse[0][numCoarse[0]++] = x;
+    }
+
+    for(y = 0; y < sampleHeight; y = NextCoarseTexel(y, sampleHeight)) {
+        coarse[1][numCoarse[1]++] = y;
+    }
+
+    count = 0;
+
+    for(by = 0; by < numCoarse[1]; by++) {
+        for(bx = 0; bx < numCoarse[0]; bx++) {
+            QueueTexel(surface, lights, thread, batch, &count,
+                coarse[1][by] * sampleWidth + coarse[0][bx]);
+        }
+    }
+
+    if(count) {
+        SampleTexels(surface, lights, thread, batch, count);
+        count = 0;
+    }
+
+    // refine the blocks that need it first, so the edges they share
+    // with smooth blocks are traced rather than interpolated
+    for(pass = 0; pass < 2; pass++) {
+        for(by = 0; by < MAX(numCoarse[1] - 1, 1); by++) {
+            y0 = coarse[1][by];
+            y1 = coarse[1][MIN(by + 1, numCoarse[1] - 1)];
+
+            for(bx = 0; bx < MAX(numCoarse[0] - 1, 1); bx++) {
+                x0 = coarse[0][bx];
+                x1 = coarse[0][MIN(bx + 1, numCoarse[0] - 1)];
+
+                corners[0] = y0 * sampleWidth + x0;
+                corners[1] = y0 * sampleWidth + x1;
+                corners[2] = y1 * sampleWidth + x0;
+                corners[3] = y1 * sampleWidth + x1;
+
+                smooth = true;
+
+                for(i = 1; i < 4; i++) {
+                    if(shadows[corners[i]] != shadows[corners[0]]) {
+                        smooth = false;
+                    }
+                }
+
+                for(j = 0; j < 3 && smooth; j++) {
+                    lo = hi = colorSamples[corners[0]][j];
+
+                    for(i = 1; i < 4; i++) {
+                        lo = MIN(lo, colorSamples[corners[i]][j]);
+                        hi = MAX(hi, colorSamples[corners[i]][j]);
+                    }
+
+                    if(hi - lo > adaptiveThreshold) {
+                        smooth = false;
+                    }
+                }
+
+                if(smooth && BlockCrossesLightRange(surface, lights, x0, y0, x1, y1)) {
+                    smooth = false;
+                }
+
+                if(smooth != (pass == 1)) {
+                    continue;
+                }
+
+                for(y = y0; y <= y1; y++) {
+                    for(x = x0; x <= x1; x++) {
+                        if(thread->texelSampled[y * sampleWidth + x]) {
+                            continue;
+                        }
+
+                        if(!smooth) {
+                            QueueTexel(surface, lights, thread, batch, &count,
+                                y * sampleWidth + x);
+                            continue;
+                        }
+
+                        fx = (x1 == x0) ? 0 : (float)(x - x0) / (float)(x1 - x0);
+                        fy = (y1 == y0) ? 0 : (float)(y - y0) / (float)(y1 - y0);
+
+                        colorSamples[y * sampleWidth + x] =
+                            (colorSamples[corners[0]] * (1 - fx) + colorSamples[corners[1]] * fx) * (1 - fy) +
+                            (colorSamples[corners[2]] * (1 - fx) + colorSamples[corners[3]] * fx) * fy;
+
+                        thread->texelSampled[y * sampleWidth + x] = 1;
+                        thread->interpolatedTexels++;
+
+#ifdef VERIFY_ADAPTIVE_SAMPLES
+                        VerifyTexel(surface, lights, thread, x, y);
+#endif
+                    }
+                }
+            }
+        }
+
+        if(count) {
+            SampleTexels(surface, lights, thread, batch, count);
+            count = 0;
         }
     }
+}
 
-    surface->lightmapCoords = (float*)Mem_Calloc(sizeof(float) *
-        surface->numVerts * 2, hb_static);
+#ifdef VERIFY_ADAPTIVE_SAMPLES
 
-    // calculate texture coordinates
-    for(i = 0; i < surface->numVerts; i++) {
-        tDelta = surface->verts[i] - bounds.min;
-        surface->lightmapCoords[i * 2 + 0] =
-            (tDelta.Dot(tCoords[0]) + x + 0.5f) / (float)textureWidth;
-        surface->lightmapCoords[i * 2 + 1] =
-            (tDelta.Dot(tCoords[1]) + y + 0.5f) / (float)textureHeight;
-    }
+//
+// kexLightmapBuilder::VerifyTexel
+//
+// Traces an interpolated texel anyway and keeps track of
+// how far off the interpolation was
+//
 
-    tOrigin = bounds.min;
+void kexLightmapBuilder::VerifyTexel(surface_t *surface, const lightList_t *lights,
+                                     lightmapThread_t *thread, const int x, const int y) {
+    kexVec3 color;
+    kexVec3 &sample = thread->colorSamples[y * surface->lightmapDims[0] + x];
+    int texel = y * surface->lightmapDims[0] + x;
+    int error;
 
-    // project tOrigin and tCoords so they lie on the plane
-    d = (plane->Distance(bounds.min) - plane->d) / plane->Normal()[axis];
-    tOrigin[axis] -= d;
+    LightTexels(surface, lights, thread, &texel, 1, &color, NULL);
 
-    for(i = 0; i < 2; i++) {
-        tCoords[i].Normalize();
-        d = plane->Distance(tCoords[i]) / plane->Normal()[axis];
-        tCoords[i][axis] -= d;
-    }
+    for(int j = 0; j < 3; j++) {
+        error = abs((int)(byte)(color[j] * 255) - (int)(byte)(sample[j] * 255));
 
-    surface->lightmapNum = numTextures - 1;
-    surface->lightmapDims[0] = width;
-    surface->lightmapDims[1] = height;
-    surface->lightmapOffs[0] = x;
-    surface->lightmapOffs[1] = y;
-    surface->lightmapOrigin = tOrigin;
-    surface->lightmapSteps[0] = tCoords[0] * (float)samples;
-    surface->lightmapSteps[1] = tCoords[1] * (float)samples;
+        if(error > thread->maxAdaptiveError) {
+            thread->maxAdaptiveError = error;
+        }
+    }
 }
 
+#endif
+
 //
 // kexLightmapBuilder::TraceSurface
 //
 
-void kexLightmapBuilder::TraceSurface(surface_t *surface) {
-    static kexVec3 colorSamples[LIGHTMAP_MAX_SIZE][LIGHTMAP_MAX_SIZE];
+void kexLightmapBuilder::TraceSurface(surface_t *surface, const lightList_t *lights,
+                                      byte *output, lightmapThread_t *thread) {
+    kexVec3 *colorSamples = thread->colorSamples;
     int sampleWidth;
     int sampleHeight;
-    kexVec3 normal;
-    kexVec3 pos;
+    int texels[TRACE_PACKET_MAX];
+    kexVec3 colors[TRACE_PACKET_MAX];
+    int count;
     int i;
     int j;
-
-    memset(colorSamples, 0, sizeof(colorSamples));
+    int k;
 
     sampleWidth = surface->lightmapDims[0];
     sampleHeight = surface->lightmapDims[1];
 
-    normal = surface->plane.Normal();
-
 #ifdef EXPORT_TEXELS_OBJ
     static int cnt = 0;
     FILE *f = fopen(Va("texels_%02d.obj", cnt++), "w");
     int indices = 0;
 #endif
 
-    for(i = 0; i < sampleHeight; i++) {
-        for(j = 0; j < sampleWidth; j++) {
-            pos = surface->lightmapOrigin + normal +
-                (surface->lightmapSteps[0] * (float)j) +
-                (surface->lightmapSteps[1] * (float)i);
+    if(adaptiveThreshold >= 0) {
+        TraceSurfaceAdaptive(surface, lights, thread);
+    }
+    else {
+        for(i = 0; i < sampleHeight; i++) {
+            for(j = 0; j < sampleWidth; j += count) {
+                count = MIN(TRACE_PACKET_MAX, sampleWidth - j);
+
+                for(k = 0; k < count; k++) {
+                    texels[k] = i * sampleWidth + j + k;
 
 #ifdef EXPORT_TEXELS_OBJ
-            ExportTexelsToObjFile(f, pos, indices);
-            indices += 8;
+                    ExportTexelsToObjFile(f, TexelOrigin(surface, j + k, i), indices);
+                    indices += 8;
 #endif
+                }
+
+                LightTexels(surface, lights, thread, texels, count, colors, NULL);
 
-            colorSamples[i][j] += LightTexelSample(pos, surface->plane);
+                for(k = 0; k < count; k++) {
+                    colorSamples[texels[k]] = colors[k];
+                }
+            }
         }
-        printf(".");
     }
 
 #ifdef EXPORT_TEXELS_OBJ
     fclose(f);
 #endif
 
-    for(i = 0; i < sampleHeight; i++) {
-        for(j = 0; j < sampleWidth; j++) {
-            int offs = (((textureWidth * (i + surface->lightmapOffs[1])) +
+    for(i = 0; i < sampleWidth * sampleHeight; i++) {
+        kexVec3 &sample = colorSamples[i];
+
+        output[i * 3 + 0] = (byte)(sample[2] * 255);
+        output[i * 3 + 1] = (byte)(sample[1] * 255);
+        output[i * 3 + 2] = (byte)(sample[0] * 255);
+    }
+}
+
+//
+// kexLightmapBuilder::BlitSurfaces
+//
+// Copies the lit texels of every surface into its block on the page
+//
+
+void kexLightmapBuilder::BlitSurfaces(void) {
+    surface_t *surface;
+    byte *texture;
+    int rowSize;
+    int offs;
+    int i;
+    unsigned int k;
+
+    for(k = 0; k < surfaces.Length(); k++) {
+        if(blockOwners && blockOwners[k] != (int)k) {
+            continue;
+        }
+
+        surface = surfaces[k];
+        texture = textures[surface->lightmapNum];
+        rowSize = surface->lightmapDims[0] * 3;
+
+        for(i = 0; i < surface->lightmapDims[1]; i++) {
+            offs = (((textureWidth * (i + surface->lightmapOffs[1])) +
                 surface->lightmapOffs[0]) * 3);
 
-            currentTexture[offs + j * 3 + 0] = (byte)(colorSamples[i][j][2] * 255);
-            currentTexture[offs + j * 3 + 1] = (byte)(colorSamples[i][j][1] * 255);
-            currentTexture[offs + j * 3 + 2] = (byte)(colorSamples[i][j][0] * 255);
+            memcpy(&texture[offs], &surfaceTexels[k][i * rowSize], rowSize);
         }
-        printf(".");
     }
 }
 
+//
+// kexLightmapBuilder::TraceSurfaceJob
+//
+
+void kexLightmapBuilder::TraceSurfaceJob(void *data, const int job, const int thread) {
+    kexLightmapBuilder *builder = static_cast<kexLightmapBuilder*>(data);
+
+    byte *texels = builder->surfaceTexels[job];
+
+    if(builder->cacheFile &&
+        builder->RestoreSurface(surfaces[job], builder->surfaceKeys[job], texels)) {
+        builder->threads[thread].cachedSurfaces++;
+    }
+    else {
+        builder->TraceSurface(surfaces[job], &builder->surfaceLights[job], texels,
+            &builder->threads[thread]);
+    }
+    printf(".");
+}
+
 //
 // kexLightmapBuilder::CreateLightmaps
 //
 
 void kexLightmapBuilder::CreateLightmaps(kexDoomMap &doomMap) {
     unsigned int i;
+    int j;
+    int maxSamples = 1;
+    int totalTexels = 0;
+    byte *texels;
+    double start;
 
     trace.Init(doomMap);
     AddThingLights(doomMap);
 
     map = &doomMap;
 
+    worker.SetNumThreads(numThreads);
+
+    if(threads) {
+        delete[] threads;
+    }
+
     printf("------------- Building lightmap -------------\n");
 
+    start = GetSeconds();
+
     for(i = 0; i < surfaces.Length(); i++) {
-        printf("Lighting surface %03d: ", i);
         BuildSurfaceParams(surfaces[i]);
-        TraceSurface(surfaces[i]);
-        printf("\n");
+
+        maxSamples = MAX(maxSamples, surfaces[i]->lightmapDims[0] * surfaces[i]->lightmapDims[1]);
+        totalTexels += surfaces[i]->lightmapDims[0] * surfaces[i]->lightmapDims[1];
+    }
+
+    printf("Surface params: %.3f seconds\n", GetSeconds() - start);
+    start = GetSeconds();
+
+    // the whole atlas is laid out before any rays are traced
+    PackBlocks();
+
+    printf("Packing: %.3f seconds\n", GetSeconds() - start);
+    PrintPageUsage();
+
+    // surfaces are lit into their own buffers and copied onto the pages
+    // afterwards, so tracing doesn't care where the blocks ended up
+    surfaceTexels = (byte**)Mem_Calloc(sizeof(byte*) * (surfaces.Length() + 1), hb_static);
+    texels = (byte*)Mem_Calloc(totalTexels * 3 + 1, hb_static);
+
+    for(i = 0; i < surfaces.Length(); i++) {
+        surfaceTexels[i] = texels;
+        texels += surfaces[i]->lightmapDims[0] * surfaces[i]->lightmapDims[1] * 3;
+    }
+
+    // every thread gets its own sample buffer, big enough for the largest
+    // surface. each surface only uses and fills in lightmapDims worth of it
+    threads = new lightmapThread_t[worker.NumThreads()];
+
+    for(j = 0; j < worker.NumThreads(); j++) {
+        threads[j].colorSamples = (kexVec3*)Mem_Calloc(sizeof(kexVec3) *
+            maxSamples, hb_static);
+        threads[j].tracedTexels = 0;
+        threads[j].culledTraces = 0;
+        threads[j].cachedSurfaces = 0;
+        threads[j].interpolatedTexels = 0;
+        threads[j].maxAdaptiveError = 0;
+        threads[j].texelShadows = NULL;
+        threads[j].texelSampled = NULL;
+
+        if(adaptiveThreshold >= 0) {
+            threads[j].texelShadows = (unsigned int*)Mem_Calloc(sizeof(unsigned int) *
+                maxSamples, hb_static);
+            threads[j].texelSampled = (byte*)Mem_Calloc(maxSamples, hb_static);
+        }
+    }
+
+    start = GetSeconds();
+
+    BuildSurfaceLights();
+    BuildSamplePattern();
+
+    if(cacheFile) {
+        BuildSurfaceKeys();
+        LoadCache();
     }
 
-    printf("\nTexels traced: %i\n\n", tracedTexels);
+    printf("Light lists: %.3f seconds\n\n", GetSeconds() - start);
+
+    printf("Lighting %i surfaces with %i thread(s)\n", surfaces.Length(), worker.NumThreads());
+
+    start = GetSeconds();
+    worker.RunJobs(surfaces.Length(), this, TraceSurfaceJob);
+    printf("\nTracing: %.3f seconds\n", GetSeconds() - start);
+
+    if(dedupeTolerance >= 0) {
+        start = GetSeconds();
+
+        DedupeBlocks();
+        ResetPages();
+        PackBlocks();
+
+        printf("Deduplicating: %.3f seconds\n", GetSeconds() - start);
+        PrintPageUsage();
+    }
+
+    start = GetSeconds();
+    BlitSurfaces();
+
+    for(i = 0; i < surfaces.Length(); i++) {
+        SetTexCoords(surfaces[i]);
+    }
+
+    printf("Blitting: %.3f seconds\n", GetSeconds() - start);
+
+    for(j = 0; j < worker.NumThreads(); j++) {
+        tracedTexels += threads[j].tracedTexels;
+        culledTraces += threads[j].culledTraces;
+        cachedSurfaces += threads[j].cachedSurfaces;
+        interpolatedTexels += threads[j].interpolatedTexels;
+        maxAdaptiveError = MAX(maxAdaptiveError, threads[j].maxAdaptiveError);
+    }
+
+    printf("Texels traced: %i\n", tracedTexels);
+    printf("Traces avoided by light culling: %lld\n", culledTraces);
+    printf("Surfaces reused from cache: %i\n", cachedSurfaces);
+
+    if(adaptiveThreshold >= 0) {
+        printf("Texels interpolated: %i\n", interpolatedTexels);
+#ifdef VERIFY_ADAPTIVE_SAMPLES
+        printf("Max interpolation error: %i\n", maxAdaptiveError);
+#endif
+    }
+
+    printf("\n");
+
+    if(cacheFile) {
+        SaveCache();
+    }
 
     for(i = 0; i < thingLights.Length(); i++) {
         // all light things should never be loaded in doom
@@ -603,6 +2491,316 @@ void kexLightmapBuilder::CreateLightmaps(kexDoomMap &doomMap) {
     }
 }
 
+//
+// PackRGB565
+//
+
+static unsigned short PackRGB565(const int *rgb) {
+    return (unsigned short)((((rgb[0] * 31 + 127) / 255) << 11) |
+                            (((rgb[1] * 63 + 127) / 255) << 5) |
+                             ((rgb[2] * 31 + 127) / 255));
+}
+
+//
+// UnpackRGB565
+//
+
+static void UnpackRGB565(const unsigned short color, int *rgb) {
+    int r = (color >> 11) & 31;
+    int g = (color >> 5) & 63;
+    int b = color & 31;
+
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+//
+// FitBC1Indices
+//
+// Picks the nearest palette entry for every texel of the block and
+// returns the total squared error
+//
+
+static int FitBC1Indices(const int colors[16][3], const unsigned short c0,
+                         const unsigned short c1, unsigned int *indices) {
+    int palette[4][3];
+    int best;
+    int bestDist;
+    int dist;
+    int error;
+    int i;
+    int j;
+    int k;
+
+    UnpackRGB565(c0, palette[0]);
+    UnpackRGB565(c1, palette[1]);
+
+    for(j = 0; j < 3; j++) {
+        palette[2][j] = (2 * palette[0][j] + palette[1][j]) / 3;
+        palette[3][j] = (palette[0][j] + 2 * palette[1][j]) / 3;
+    }
+
+    *indices = 0;
+    error = 0;
+
+    for(i = 0; i < 16; i++) {
+        best = 0;
+        bestDist = D_MAXINT;
+
+        for(k = 0; k < 4; k++) {
+            dist = 0;
+
+            for(j = 0; j < 3; j++) {
+                dist += (colors[i][j] - palette[k][j]) * (colors[i][j] - palette[k][j]);
+            }
+
+            if(dist < bestDist) {
+                bestDist = dist;
+                best = k;
+            }
+        }
+
+        *indices |= best << (i * 2);
+        error += bestDist;
+    }
+
+    return error;
+}
+
+//
+// RefineBC1Endpoints
+//
+// Least squares fit of both endpoints to the texels, given which
+// palette entry each texel picked
+//
+
+static bool RefineBC1Endpoints(const int colors[16][3], const unsigned int indices,
+                               unsigned short *c0, unsigned short *c1) {
+    static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    float aa = 0;
+    float bb = 0;
+    float ab = 0;
+    float ax[3] = { 0, 0, 0 };
+    float bx[3] = { 0, 0, 0 };
+    float alpha;
+    float beta;
+    float det;
+    int end0[3];
+    int end1[3];
+    int i;
+    int j;
+
+    for(i = 0; i < 16; i++) {
+        alpha = weights[(indices >> (i * 2)) & 3];
+        beta = 1.0f - alpha;
+
+        aa += alpha * alpha;
+        bb += beta * beta;
+        ab += alpha * beta;
+
+        for(j = 0; j < 3; j++) {
+            ax[j] += alpha * colors[i][j];
+            bx[j] += beta * colors[i][j];
+        }
+    }
+
+    det = aa * bb - ab * ab;
+
+    if(kexMath::Fabs(det) < 0.0001f) {
+        return false;
+    }
+
+    for(j = 0; j < 3; j++) {
+        end0[j] = (int)((ax[j] * bb - bx[j] * ab) / det + 0.5f);
+        end1[j] = (int)((bx[j] * aa - ax[j] * ab) / det + 0.5f);
+
+        end0[j] = BETWEEN(0, 255, end0[j]);
+        end1[j] = BETWEEN(0, 255, end1[j]);
+    }
+
+    *c0 = PackRGB565(end0);
+    *c1 = PackRGB565(end1);
+    return true;
+}
+
+//
+// EncodeBC1Block
+//
+// Fits the 4x4 block to a line through its colors along their principal
+// axis, the same approach most realtime DXT1 encoders take, followed by
+// one least squares pass over the endpoints. Pages are stored BGR like
+// the tga output, the block is encoded as RGB
+//
+
+static void EncodeBC1Block(const byte *page, const int width, const int height,
+                           const int bx, const int by, byte *out) {
+    int colors[16][3];
+    float mean[3];
+    float cov[6];
+    float axis[3];
+    float tmp[3];
+    float d[3];
+    float dot;
+    float lo;
+    float hi;
+    float len;
+    int loIndex;
+    int hiIndex;
+    int error;
+    unsigned short c0;
+    unsigned short c1;
+    unsigned short r0;
+    unsigned short r1;
+    unsigned short swap;
+    unsigned int indices;
+    unsigned int refined;
+    int x;
+    int y;
+    int i;
+    int j;
+    int k;
+
+    for(i = 0; i < 16; i++) {
+        // edge blocks of pages smaller than 4 texels repeat the last texel
+        x = MIN(bx * 4 + (i & 3), width - 1);
+        y = MIN(by * 4 + (i >> 2), height - 1);
+
+        colors[i][0] = page[(y * width + x) * 3 + 2];
+        colors[i][1] = page[(y * width + x) * 3 + 1];
+        colors[i][2] = page[(y * width + x) * 3 + 0];
+    }
+
+    mean[0] = mean[1] = mean[2] = 0;
+
+    for(i = 0; i < 16; i++) {
+        for(j = 0; j < 3; j++) {
+            mean[j] += colors[i][j] / 16.0f;
+        }
+    }
+
+    for(i = 0; i < 6; i++) {
+        cov[i] = 0;
+    }
+
+    for(i = 0; i < 16; i++) {
+        for(j = 0; j < 3; j++) {
+            d[j] = colors[i][j] - mean[j];
+        }
+
+        cov[0] += d[0] * d[0];
+        cov[1] += d[0] * d[1];
+        cov[2] += d[0] * d[2];
+        cov[3] += d[1] * d[1];
+        cov[4] += d[1] * d[2];
+        cov[5] += d[2] * d[2];
+    }
+
+    // power iteration for the principal axis
+    axis[0] = axis[1] = axis[2] = 1;
+
+    for(k = 0; k < 4; k++) {
+        tmp[0] = axis[0] * cov[0] + axis[1] * cov[1] + axis[2] * cov[2];
+        tmp[1] = axis[0] * cov[1] + axis[1] * cov[3] + axis[2] * cov[4];
+        tmp[2] = axis[0] * cov[2] + axis[1] * cov[4] + axis[2] * cov[5];
+
+        len = MAX(kexMath::Fabs(tmp[0]), MAX(kexMath::Fabs(tmp[1]), kexMath::Fabs(tmp[2])));
+
+        if(len < 0.0001f) {
+            break;
+        }
+
+        axis[0] = tmp[0] / len;
+        axis[1] = tmp[1] / len;
+        axis[2] = tmp[2] / len;
+    }
+
+    lo = hi = colors[0][0] * axis[0] + colors[0][1] * axis[1] + colors[0][2] * axis[2];
+    loIndex = hiIndex = 0;
+
+    for(i = 1; i < 16; i++) {
+        dot = colors[i][0] * axis[0] + colors[i][1] * axis[1] + colors[i][2] * axis[2];
+
+        if(dot < lo) {
+            lo = dot;
+            loIndex = i;
+        }
+        if(dot > hi) {
+            hi = dot;
+            hiIndex = i;
+        }
+    }
+
+    c0 = PackRGB565(colors[hiIndex]);
+    c1 = PackRGB565(colors[loIndex]);
+
+    // c0 > c1 picks the four color mode
+    if(c0 < c1) {
+        swap = c0;
+        c0 = c1;
+        c1 = swap;
+    }
+
+    indices = 0;
+
+    if(c0 != c1) {
+        error = FitBC1Indices(colors, c0, c1, &indices);
+
+        if(RefineBC1Endpoints(colors, indices, &r0, &r1)) {
+            if(r0 < r1) {
+                swap = r0;
+                r0 = r1;
+                r1 = swap;
+            }
+
+            if(r0 != r1 && FitBC1Indices(colors, r0, r1, &refined) < error) {
+                c0 = r0;
+                c1 = r1;
+                indices = refined;
+            }
+        }
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    out[4] = indices & 0xff;
+    out[5] = (indices >> 8) & 0xff;
+    out[6] = (indices >> 16) & 0xff;
+    out[7] = (indices >> 24) & 0xff;
+}
+
+//
+// kexLightmapBuilder::EncodePage
+//
+// Returns the size of the encoded page
+//
+
+int kexLightmapBuilder::EncodePage(const byte *page, byte *out) {
+    int blocksWide;
+    int blocksHigh;
+    int x;
+    int y;
+
+    if(encoding == LIGHTMAP_ENCODING_RAW) {
+        memcpy(out, page, textureWidth * textureHeight * 3);
+        return textureWidth * textureHeight * 3;
+    }
+
+    blocksWide = (textureWidth + 3) / 4;
+    blocksHigh = (textureHeight + 3) / 4;
+
+    for(y = 0; y < blocksHigh; y++) {
+        for(x = 0; x < blocksWide; x++) {
+            EncodeBC1Block(page, textureWidth, textureHeight, x, y,
+                &out[(y * blocksWide + x) * 8]);
+        }
+    }
+
+    return blocksWide * blocksHigh * 8;
+}
+
 //
 // kexLightmapBuilder::CreateLightmapLump
 //
@@ -614,6 +2812,11 @@ byte *kexLightmapBuilder::CreateLightmapLump(int *size) {
     int numTexCoords;
     int coordOffsets;
     byte *data;
+    byte *page;
+    int pageSize;
+    int totalSize;
+    double start;
+    short *coords;
     kexBinFile lumpFile;
     fint_t fuv;
 
@@ -626,9 +2829,17 @@ byte *kexLightmapBuilder::CreateLightmapLump(int *size) {
         lumpSize += (surfaces[i]->numVerts * 2) * sizeof(short);
     }
 
-    data = (byte*)Mem_Calloc(lumpSize, hb_static);
+    // the lump has to outlive the map when several get lit in one run
+    data = (byte*)Mem_Calloc(lumpSize, hb_file);
     lumpFile.SetBuffer(data);
 
+    // the original layout starts with the surface count, so a negative
+    // version tells newer readers that an encoding field follows
+    if(encoding != LIGHTMAP_ENCODING_RAW) {
+        lumpFile.Write32(-LIGHTMAP_LUMP_VERSION);
+        lumpFile.Write32(encoding);
+    }
+
     lumpFile.Write32(surfaces.Length());
     coordOffsets = 0;
     numTexCoords = 0;
@@ -646,21 +2857,46 @@ byte *kexLightmapBuilder::CreateLightmapLump(int *size) {
 
     lumpFile.Write32(numTexCoords);
 
+    coords = (short*)Mem_Malloc(sizeof(short) * MAX(numTexCoords, 1), hb_static);
+    numTexCoords = 0;
+
     for(i = 0; i < surfaces.Length(); i++) {
         for(j = 0; j < surfaces[i]->numVerts * 2; j++) {
             fuv.f = surfaces[i]->lightmapCoords[j];
-            lumpFile.Write16(fuv.i >> 16);
+            coords[numTexCoords++] = fuv.i >> 16;
         }
     }
 
+    lumpFile.WriteArray(coords, numTexCoords);
+    Mem_Free(coords);
+
     lumpFile.Write32(textures.Length());
     lumpFile.Write32(textureWidth);
     lumpFile.Write32(textureHeight);
 
-    for(i = 0; i < textures.Length(); i++) {
-        for(j = 0; j < (textureWidth * textureHeight) * 3; j++) {
-            lumpFile.Write8(textures[i][j]);
+    if(encoding == LIGHTMAP_ENCODING_RAW) {
+        for(i = 0; i < textures.Length(); i++) {
+            lumpFile.WriteBytes(textures[i], (textureWidth * textureHeight) * 3);
+        }
+    }
+    else {
+        totalSize = 0;
+
+        for(i = 0; i < textures.Length(); i++) {
+            page = lumpFile.BufferAt();
+
+            start = GetSeconds();
+            pageSize = EncodePage(textures[i], page);
+
+            printf("Page %i: %i -> %i bytes in %.3f ms\n", i, textureWidth * textureHeight * 3,
+                pageSize, (GetSeconds() - start) * 1000.0);
+
+            lumpFile.SetOffset((page + pageSize) - lumpFile.Buffer());
+            totalSize += pageSize;
         }
+
+        printf("Pages encoded: %i bytes saved\n\n",
+            textureWidth * textureHeight * 3 * textures.Length() - totalSize);
     }
 
     *size = lumpFile.BufferAt() - lumpFile.Buffer();
@@ -671,11 +2907,11 @@ byte *kexLightmapBuilder::CreateLightmapLump(int *size) {
 // kexLightmapBuilder::WriteTexturesToTGA
 //
 
-void kexLightmapBuilder::WriteTexturesToTGA(void) {
+void kexLightmapBuilder::WriteTexturesToTGA(const char *prefix) {
     kexBinFile file;
 
     for(unsigned int i = 0; i < textures.Length(); i++) {
-        file.Create(Va("lightmap_%02d.tga", i));
+        file.Create(Va("%slightmap_%02d.tga", prefix, i));
         file.Write16(0);
         file.Write16(2);
         file.Write16(0);
@@ -685,10 +2921,7 @@ void kexLightmapBuilder::WriteTexturesToTGA(void) {
         file.Write16(textureWidth);
         file.Write16(textureHeight);
         file.Write16(24);
-
-        for(int j = 0; j < (textureWidth * textureHeight) * 3; j++) {
-            file.Write8(textures[i][j]);
-        }
+        file.WriteBytes(textures[i], (textureWidth * textureHeight) * 3);
         file.Close();
     }
 }
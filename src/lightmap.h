@@ -29,41 +29,162 @@
 
 #define LIGHTMAP_MAX_SIZE  1024
 
+#define LIGHTMAP_LUMP_VERSION   2
+
+#define LIGHTGRID_CELL_SIZE 256
+#define LIGHTGRID_MAX_CELLS 256
+
+#define LIGHTMAP_ADAPTIVE_STEP  4
+
+#define LIGHTMAP_MAX_SAMPLES    16
+#define LIGHTMAP_SAMPLE_SEED    0x444c4954
+
+#define LIGHTMAP_CACHE_ID       0x41434c44  // 'DLCA'
+#define LIGHTMAP_CACHE_VERSION  3
+#define LIGHTMAP_CACHE_SEED     0xcbf29ce484222325ULL
+
 typedef enum {
     AXIS_YZ     = 0,
     AXIS_XZ,
     AXIS_XY
 } lightmapAxis_t;
 
+typedef enum {
+    LIGHTMAP_PACKER_SKYLINE = 0,
+    LIGHTMAP_PACKER_MAXRECTS
+} lightmapPacker_t;
+
+typedef enum {
+    LIGHTMAP_ENCODING_RAW   = 0,
+    LIGHTMAP_ENCODING_BC1
+} lightmapEncoding_t;
+
+typedef struct {
+    int                     x;
+    int                     y;
+    int                     width;
+    int                     height;
+} packRect_t;
+
+typedef struct {
+    packRect_t              *freeRects;
+    int                     numFreeRects;
+    int                     maxFreeRects;
+} packPage_t;
+
 class kexTrace;
 
+typedef struct {
+    int                     first;
+    int                     count;
+} lightList_t;
+
+typedef struct {
+    mapSector_t             *sector;
+    surface_t               *surface;
+    kexVec3                 dir;
+} ceilingLight_t;
+
+typedef struct {
+    kexVec3                 *colorSamples;
+    int                     tracedTexels;
+    long long               culledTraces;
+    int                     cachedSurfaces;
+    unsigned int            *texelShadows;
+    byte                    *texelSampled;
+    int                     interpolatedTexels;
+    int                     maxAdaptiveError;
+} lightmapThread_t;
+
+typedef struct {
+    unsigned long long      key;
+    int                     width;
+    int                     height;
+    byte                    *texels;
+} lightmapCacheEntry_t;
+
 class kexLightmapBuilder {
 public:
                             kexLightmapBuilder(void);
                             ~kexLightmapBuilder(void);
 
     void                    BuildSurfaceParams(surface_t *surface);
-    void                    TraceSurface(surface_t *surface);
+    void                    TraceSurface(surface_t *surface, const lightList_t *lights,
+                                         byte *output, lightmapThread_t *thread);
     void                    AddThingLights(kexDoomMap &doomMap);
     void                    CreateLightmaps(kexDoomMap &doomMap);
-    void                    WriteTexturesToTGA(void);
+    void                    WriteTexturesToTGA(const char *prefix = "");
     byte                    *CreateLightmapLump(int *size);
+    void                    Reset(void);
 
     kexTrace                trace;
     int                     samples;
     float                   ambience;
     int                     textureWidth;
     int                     textureHeight;
+    int                     numThreads;
+    const char              *cacheFile;
+    float                   adaptiveThreshold;
+    int                     extraSamples;
+    lightmapPacker_t        packer;
+    int                     dedupeTolerance;
+    lightmapEncoding_t      encoding;
 
 private:
     void                    NewTexture(void);
     bool                    MakeRoomForBlock(const int width, const int height, int *x, int *y);
+    void                    PlaceSurface(surface_t *surface, const int page, const int x, const int y);
+    void                    SetTexCoords(surface_t *surface);
+    void                    PackBlocks(void);
+    void                    ResetPages(void);
+    bool                    BlockFitsInside(const int surfaceNum, const int ownerNum);
+    unsigned long long      HashBlock(const int surfaceNum);
+    void                    DedupeBlocks(void);
+    void                    AllocateSkylineBlock(surface_t *surface);
+    void                    PackMaxRects(void);
+    void                    PrintPageUsage(void);
     kexBBox                 GetBoundsFromSurface(const surface_t *surface);
-    kexVec3                 LightTexelSample(const kexVec3 &origin, kexPlane &plane);
+    kexBBox                 GetTexelBounds(const surface_t *surface);
+    void                    GetSurfaceSectors(const surface_t *surface, mapSector_t **sectors);
+    void                    BuildLightGrid(void);
+    void                    BuildSurfaceLights(void);
+    void                    LightTexelSamples(lightmapThread_t *thread, const lightList_t *lights,
+                                              const kexVec3 *origins, const int count,
+                                              kexPlane &plane, kexVec3 *colors,
+                                              unsigned int *shadows);
+    kexVec3                 TexelOrigin(const surface_t *surface, const int x, const int y);
+    bool                    BlockCrossesLightRange(const surface_t *surface, const lightList_t *lights,
+                                                   const int x0, const int y0,
+                                                   const int x1, const int y1);
+    void                    BuildSamplePattern(void);
+    void                    LightTexels(surface_t *surface, const lightList_t *lights,
+                                        lightmapThread_t *thread, const int *texels,
+                                        const int count, kexVec3 *colors, unsigned int *shadows);
+    void                    SampleTexels(surface_t *surface, const lightList_t *lights,
+                                         lightmapThread_t *thread, const int *texels,
+                                         const int count);
+    void                    QueueTexel(surface_t *surface, const lightList_t *lights,
+                                       lightmapThread_t *thread, int *batch, int *count,
+                                       const int texel);
+    void                    TraceSurfaceAdaptive(surface_t *surface, const lightList_t *lights,
+                                                 lightmapThread_t *thread);
+    void                    VerifyTexel(surface_t *surface, const lightList_t *lights,
+                                        lightmapThread_t *thread, const int x, const int y);
+    void                    SetupCeilingLights(kexDoomMap &doomMap);
     bool                    EmitFromCeiling(const kexVec3 &origin, const kexVec3 &normal,
-                                            const mapThing_t *light, float *dist);
+                                            const ceilingLight_t *ceiling, float *dist);
+    unsigned long long      HashSurfaceGeometry(unsigned long long hash, const surface_t *surface);
+    void                    BuildSurfaceKeys(void);
+    void                    LoadCache(void);
+    void                    SaveCache(void);
+    bool                    RestoreSurface(surface_t *surface, const unsigned long long key,
+                                           byte *texels);
+    void                    BlitSurfaces(void);
+    int                     EncodePage(const byte *page, byte *out);
     void                    ExportTexelsToObjFile(FILE *f, const kexVec3 &org, int indices);
 
+    static void             TraceSurfaceJob(void *data, const int job, const int thread);
+
     kexDoomMap              *map;
     mapLightInfo_t          *lightInfos;
     kexArray<mapThing_t*>   thingLights;
@@ -71,8 +192,27 @@ private:
     byte                    *currentTexture;
     int                     *allocBlocks;
     int                     numTextures;
-    int                     extraSamples;
     int                     tracedTexels;
+    long long               culledTraces;
+    int                     cachedSurfaces;
+    int                     interpolatedTexels;
+    int                     maxAdaptiveError;
+    float                   lightGridOrigin[2];
+    float                   lightGridCellSize;
+    int                     lightGridSize[2];
+    lightList_t             *lightGrid;
+    int                     *lightGridLights;
+    lightList_t             *surfaceLights;
+    int                     *surfaceLightNums;
+    ceilingLight_t          *ceilingLights;
+    unsigned long long      *surfaceKeys;
+    byte                    **surfaceTexels;
+    int                     *blockOwners;
+    lightmapCacheEntry_t    *cacheEntries;
+    int                     numCacheEntries;
+    float                   samplePattern[LIGHTMAP_MAX_SAMPLES][2];
+    kexWorker               worker;
+    lightmapThread_t        *threads;
 };
 
 #endif
@@ -27,11 +27,14 @@
 //
 //-----------------------------------------------------------------------------
 
+#include <chrono>
+
 #include "common.h"
 #include "wad.h"
 #include "mapData.h"
 #include "surfaces.h"
 #include "trace.h"
+#include "worker.h"
 #include "lightmap.h"
 
 //
@@ -63,17 +66,34 @@ char *Va(char *str, ...) {
     return vastr;	
 }
 
+//
+// GetSeconds
+//
+
+double GetSeconds(void) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 //
 // Main
 //
 
 int main(int argc, char **argv) {
     kexWadFile wadFile;
-    kexDoomMap doomMap;
     kexLightmapBuilder builder;
+    kexArray<const char*> mapNames;
+    kexArray<int> mapList;
+    bool bAllMaps = false;
+    const char *cacheFile;
+    kexStr cacheName;
+    kexStr tgaPrefix;
+    byte *lm;
+    int lump;
     int size;
-    int map = 1;
     int arg = 1;
+    unsigned int i;
+    double start;
 
     printf("DLight (c) 2013-2014 Samuel Villarreal\n\n");
 
@@ -86,12 +106,28 @@ int main(int argc, char **argv) {
         if(!strcmp(argv[arg], "-help")) {
             printf("Options:\n");
             printf("-help:              displays all known options\n");
-            printf("-map:               process lightmap for MAP##\n");
+            printf("-map:               process lightmap for MAP## or a map lump by name,\n");
+            printf("                    may be given more than once\n");
+            printf("-allmaps:           process lightmaps for every map in the wad\n");
             printf("-samples:           set texel sampling size (lowest = higher quaility but\n");
             printf("                    slow compile time) must be in powers of two\n");
+            printf("-extrasamples:      extra rays per texel to smooth out shadow edges\n");
+            printf("                    (0 - %i)\n", LIGHTMAP_MAX_SAMPLES - 1);
             printf("-ambience:          set global ambience value for lightmaps (0.0 - 1.0)\n");
             printf("-size:              lightmap texture dimentions for width and height\n");
             printf("                    must be in powers of two (1, 2, 4, 8, 16, etc)\n");
+            printf("-packer:            lightmap page packing, skyline (default) or maxrects\n");
+            printf("-dedupe:            let surfaces share a lightmap block when their texels\n");
+            printf("                    differ by no more than this many color levels\n");
+            printf("-compress:          lightmap page encoding in the lump, none (default) or\n");
+            printf("                    bc1 (needs an engine that reads the newer lump header)\n");
+            printf("-threads:           number of threads used for tracing surfaces\n");
+            printf("                    (0 = one per cpu core)\n");
+            printf("-accel:             ray acceleration structure, bsp (default) or bvh\n");
+            printf("-adaptive:          trace every %i texels and only fill in the rest where\n", LIGHTMAP_ADAPTIVE_STEP);
+            printf("                    neighbours differ by more than this many color levels\n");
+            printf("-cache:             file that keeps lit surfaces between runs, only\n");
+            printf("                    surfaces whose lights or geometry changed get rebaked\n");
             arg++;
             return 0;
         }
@@ -101,7 +137,11 @@ int main(int argc, char **argv) {
                 return 1;
             }
 
-            map = atoi(argv[++arg]);
+            mapNames.Push(argv[++arg]);
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-allmaps")) {
+            bAllMaps = true;
             arg++;
         }
         else if(!strcmp(argv[arg], "-samples")) {
@@ -119,6 +159,22 @@ int main(int argc, char **argv) {
             }
 
             builder.samples = kexMath::RoundPowerOfTwo(builder.samples);
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-extrasamples")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify value for -extrasamples\n");
+                return 1;
+            }
+
+            builder.extraSamples = atoi(argv[++arg]);
+            if(builder.extraSamples < 0) {
+                builder.extraSamples = 0;
+            }
+            if(builder.extraSamples > LIGHTMAP_MAX_SAMPLES - 1) {
+                builder.extraSamples = LIGHTMAP_MAX_SAMPLES - 1;
+            }
+            arg++;
         }
         else if(!strcmp(argv[arg], "-ambience")) {
             if(argv[arg+1] == NULL) {
@@ -133,6 +189,7 @@ int main(int argc, char **argv) {
             if(builder.ambience > 1) {
                 builder.ambience = 1;
             }
+            arg++;
         }
         else if(!strcmp(argv[arg], "-size")) {
             int lmDims;
@@ -154,6 +211,120 @@ int main(int argc, char **argv) {
 
             builder.textureWidth = lmDims;
             builder.textureHeight = lmDims;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-accel")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify bsp or bvh for -accel\n");
+                return 1;
+            }
+
+            arg++;
+
+            if(!strcmp(argv[arg], "bsp")) {
+                builder.trace.accel = TRACE_ACCEL_BSP;
+            }
+            else if(!strcmp(argv[arg], "bvh")) {
+                builder.trace.accel = TRACE_ACCEL_BVH;
+            }
+            else {
+                Error("Unknown -accel type: %s\n", argv[arg]);
+                return 1;
+            }
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-adaptive")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify value for -adaptive\n");
+                return 1;
+            }
+
+            builder.adaptiveThreshold = (float)atof(argv[++arg]);
+            if(builder.adaptiveThreshold < 0) {
+                builder.adaptiveThreshold = 0;
+            }
+            if(builder.adaptiveThreshold > 255) {
+                builder.adaptiveThreshold = 255;
+            }
+
+            builder.adaptiveThreshold /= 255.0f;
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-cache")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify file for -cache\n");
+                return 1;
+            }
+
+            builder.cacheFile = argv[++arg];
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-packer")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify skyline or maxrects for -packer\n");
+                return 1;
+            }
+
+            arg++;
+
+            if(!strcmp(argv[arg], "skyline")) {
+                builder.packer = LIGHTMAP_PACKER_SKYLINE;
+            }
+            else if(!strcmp(argv[arg], "maxrects")) {
+                builder.packer = LIGHTMAP_PACKER_MAXRECTS;
+            }
+            else {
+                Error("Unknown -packer type: %s\n", argv[arg]);
+                return 1;
+            }
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-dedupe")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify value for -dedupe\n");
+                return 1;
+            }
+
+            builder.dedupeTolerance = atoi(argv[++arg]);
+            if(builder.dedupeTolerance < 0) {
+                builder.dedupeTolerance = 0;
+            }
+            if(builder.dedupeTolerance > 255) {
+                builder.dedupeTolerance = 255;
+            }
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-compress")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify none or bc1 for -compress\n");
+                return 1;
+            }
+
+            arg++;
+
+            if(!strcmp(argv[arg], "none")) {
+                builder.encoding = LIGHTMAP_ENCODING_RAW;
+            }
+            else if(!strcmp(argv[arg], "bc1")) {
+                builder.encoding = LIGHTMAP_ENCODING_BC1;
+            }
+            else {
+                Error("Unknown -compress type: %s\n", argv[arg]);
+                return 1;
+            }
+            arg++;
+        }
+        else if(!strcmp(argv[arg], "-threads")) {
+            if(argv[arg+1] == NULL) {
+                Error("Specify value for -threads\n");
+                return 1;
+            }
+
+            builder.numThreads = atoi(argv[++arg]);
+            if(builder.numThreads < 0) {
+                builder.numThreads = 0;
+            }
+            arg++;
         }
         else {
             break;
@@ -169,25 +340,91 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    printf("------------- Building level structures -------------\n\n");
-    wadFile.SetCurrentMap(map);
-    doomMap.BuildMapFromWad(wadFile);
+    if(bAllMaps) {
+        wadFile.FindAllMaps(mapList);
+
+        if(mapList.Length() == 0) {
+            Error("No maps found in %s\n", argv[arg]);
+            return 1;
+        }
+    }
+    else {
+        for(i = 0; i < mapNames.Length(); i++) {
+            if(isdigit(mapNames[i][0])) {
+                lump = wadFile.FindMap(Va("MAP%02d", atoi(mapNames[i])));
+            }
+            else {
+                lump = wadFile.FindMap(mapNames[i]);
+            }
+
+            if(lump == -1) {
+                Error("Map %s not found\n", mapNames[i]);
+                return 1;
+            }
 
-    printf("------------- Allocating surfaces from level -------------\n\n");
-    Surface_AllocateFromMap(doomMap);
+            mapList.Push(lump);
+        }
 
-    printf("------------- Creating lightmaps -------------\n\n");
-    builder.CreateLightmaps(doomMap);
-    builder.WriteTexturesToTGA();
+        if(mapList.Length() == 0) {
+            wadFile.SetCurrentMap(1);
+            mapList.Push(wadFile.mapLumpID);
+        }
+    }
 
-    printf("------------- Creating lightmap lump -------------\n\n");
-    byte *lm = builder.CreateLightmapLump(&size);
+    cacheFile = builder.cacheFile;
+
+    // every map is lit on its own and its lump is queued up, the wad
+    // then only gets rebuilt once
+    for(i = 0; i < mapList.Length(); i++) {
+        kexDoomMap doomMap;
+
+        wadFile.SetCurrentMapLump(mapList[i]);
+
+        if(mapList.Length() > 1) {
+            printf("------------- Lighting %s (%i of %i) -------------\n\n",
+                wadFile.mapName, i + 1, mapList.Length());
+
+            tgaPrefix = Va("%s_", wadFile.mapName);
+
+            // each map keeps its own cache
+            if(cacheFile) {
+                cacheName = Va("%s.%s", cacheFile, wadFile.mapName);
+                builder.cacheFile = cacheName.c_str();
+            }
+        }
+
+        printf("------------- Building level structures -------------\n\n");
+        doomMap.BuildMapFromWad(wadFile);
+
+        printf("------------- Allocating surfaces from level -------------\n\n");
+        start = GetSeconds();
+        Surface_AllocateFromMap(doomMap);
+        printf("Surfaces allocated in %.3f seconds\n\n", GetSeconds() - start);
+
+        printf("------------- Creating lightmaps -------------\n\n");
+        builder.CreateLightmaps(doomMap);
+        builder.WriteTexturesToTGA(tgaPrefix);
+
+        printf("------------- Creating lightmap lump -------------\n\n");
+        lm = builder.CreateLightmapLump(&size);
+        wadFile.AddLightmapLump(lm, size);
+
+        // nothing from this map is needed anymore besides its lump
+        builder.Reset();
+        surfaces.Empty();
+        Mem_Purge(hb_static);
+        Mem_Purge(hb_map);
+    }
 
     printf("------------- Rebuilding wad -------------\n\n");
-    wadFile.BuildNewWad(lm, size);
+    start = GetSeconds();
+    wadFile.BuildNewWad();
+    printf("Wad rebuilt in %.3f seconds\n\n", GetSeconds() - start);
     wadFile.Close();
 
     printf("------------- Shutting down -------------\n\n");
     Mem_Purge(hb_static);
+    Mem_Purge(hb_map);
+    Mem_Purge(hb_file);
     return 0;
 }
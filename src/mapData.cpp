@@ -44,6 +44,7 @@ kexDoomMap::kexDoomMap(void) {
     this->mapSSects         = NULL;
     this->nodes             = NULL;
     this->leafs             = NULL;
+    this->mapReject         = NULL;
     this->ssLeafLookup      = NULL;
     this->ssLeafCount       = NULL;
     this->segSurfaces[0]    = NULL;
@@ -60,6 +61,7 @@ kexDoomMap::kexDoomMap(void) {
     this->numSegs       = 0;
     this->numSSects     = 0;
     this->numNodes      = 0;
+    this->numRejectBytes = 0;
 }
 
 //
@@ -83,6 +85,7 @@ void kexDoomMap::BuildMapFromWad(kexWadFile &wadFile) {
     wadFile.GetMapLump<mapSubSector_t>(ML_SUBSECTORS, &mapSSects, &numSSects);
     wadFile.GetMapLump<mapNode_t>(ML_NODES, &nodes, &numNodes);
     wadFile.GetMapLump<mapLightInfo_t>(ML_LIGHTS, &lightInfos, &numLightInfos);
+    wadFile.GetMapLump<byte>(ML_REJECT, &mapReject, &numRejectBytes);
 
     if(mapSegs == NULL) {
         Error("kexDoomMap::BuildMapFromWad: SEGS lump not found\n");
@@ -157,11 +160,11 @@ void kexDoomMap::BuildLeafs(kexWadFile &wadFile) {
         return;
     }
 
-    leafs = (leaf_t*)Mem_Calloc((size * 2) * sizeof(leaf_t), hb_static);
+    leafs = (leaf_t*)Mem_Calloc((size * 2) * sizeof(leaf_t), hb_map);
     numLeafs = numSSects;
 
-    ssLeafLookup = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_static);
-    ssLeafCount = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_static);
+    ssLeafLookup = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_map);
+    ssLeafCount = (int*)Mem_Calloc(sizeof(int) * numSSects, hb_map);
 
     count = 0;
 
@@ -311,3 +314,27 @@ mapSubSector_t *kexDoomMap::PointInSubSector(const int x, const int y) {
     
     return &mapSSects[nodenum & ~NF_SUBSECTOR];
 }
+
+//
+// kexDoomMap::CheckSectorVisibility
+//
+// Returns false only when the reject table says that nothing in one
+// sector can be seen from the other. A missing or short table can't
+// rule anything out
+//
+
+bool kexDoomMap::CheckSectorVisibility(const mapSector_t *s1, const mapSector_t *s2) {
+    int bit;
+
+    if(s1 == NULL || s2 == NULL || mapReject == NULL) {
+        return true;
+    }
+
+    bit = (s1 - mapSectors) * numSectors + (s2 - mapSectors);
+
+    if((bit >> 3) >= numRejectBytes) {
+        return true;
+    }
+
+    return !(mapReject[bit >> 3] & BIT(bit & 7));
+}
@@ -145,6 +145,7 @@ public:
     mapSector_t     *GetBackSector(const mapSeg_t *seg);
     mapSector_t     *GetSectorFromSubSector(const mapSubSector_t *sub);
     mapSubSector_t  *PointInSubSector(const int x, const int y);
+    bool            CheckSectorVisibility(const mapSector_t *s1, const mapSector_t *s2);
 
     mapThing_t      *mapThings;
     mapLineDef_t    *mapLines;
@@ -156,6 +157,7 @@ public:
     mapNode_t       *nodes;
     mapLightInfo_t  *lightInfos;
     leaf_t          *leafs;
+    byte            *mapReject;
 
     int             numThings;
     int             numLines;
@@ -167,6 +169,7 @@ public:
     int             numNodes;
     int             numLightInfos;
     int             numLeafs;
+    int             numRejectBytes;
 
     int             *ssLeafLookup;
     int             *ssLeafCount;
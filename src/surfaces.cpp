@@ -69,9 +69,9 @@ static void Surface_AllocateFromSeg(kexDoomMap &doomMap, mapSeg_t *seg) {
         // bottom seg
         if(bottom < bBottom) {
             if(side->bottomtexture != -1) {
-                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
                 surf->numVerts = 4;
-                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_static);
+                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_map);
 
                 surf->verts[0].x = surf->verts[2].x = F(doomMap.mapVerts[seg->v1].x);
                 surf->verts[0].y = surf->verts[2].y = F(doomMap.mapVerts[seg->v1].y);
@@ -96,9 +96,9 @@ static void Surface_AllocateFromSeg(kexDoomMap &doomMap, mapSeg_t *seg) {
         // top seg
         if(top > bTop) {
             if(side->toptexture != -1) {
-                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+                surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
                 surf->numVerts = 4;
-                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_static);
+                surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_map);
 
                 surf->verts[0].x = surf->verts[2].x = F(doomMap.mapVerts[seg->v1].x);
                 surf->verts[0].y = surf->verts[2].y = F(doomMap.mapVerts[seg->v1].y);
@@ -123,9 +123,9 @@ static void Surface_AllocateFromSeg(kexDoomMap &doomMap, mapSeg_t *seg) {
 
     // middle seg
     if(back == NULL) {
-        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
         surf->numVerts = 4;
-        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_static);
+        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * 4, hb_map);
 
         surf->verts[0].x = surf->verts[2].x = F(doomMap.mapVerts[seg->v1].x);
         surf->verts[0].y = surf->verts[2].y = F(doomMap.mapVerts[seg->v1].y);
@@ -162,9 +162,9 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap) {
     printf("------------- Building leaf surfaces -------------\n");
 
     doomMap.leafSurfaces[0] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-        doomMap.numSSects, hb_static);
+        doomMap.numSSects, hb_map);
     doomMap.leafSurfaces[1] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-        doomMap.numSSects, hb_static);
+        doomMap.numSSects, hb_map);
 
     for(i = 0; i < doomMap.numSSects; i++) {
         if(doomMap.ssLeafCount[i] < 3) {
@@ -180,9 +180,9 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap) {
             return;
         }
 
-        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
         surf->numVerts = doomMap.ssLeafCount[i];
-        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_static);
+        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_map);
 
         // floor verts
         for(j = 0; j < surf->numVerts; j++) {
@@ -202,9 +202,9 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap) {
 
         surfaces.Push(surf);
 
-        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_static);
+        surf = (surface_t*)Mem_Calloc(sizeof(surface_t), hb_map);
         surf->numVerts = doomMap.ssLeafCount[i];
-        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_static);
+        surf->verts = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surf->numVerts, hb_map);
 
         // ceiling verts
         for(j = 0; j < surf->numVerts; j++) {
@@ -236,11 +236,14 @@ static void Surface_AllocateFromLeaf(kexDoomMap &doomMap) {
 
 void Surface_AllocateFromMap(kexDoomMap &doomMap) {
     doomMap.segSurfaces[0] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-        doomMap.numSegs, hb_static);
+        doomMap.numSegs, hb_map);
     doomMap.segSurfaces[1] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-        doomMap.numSegs, hb_static);
+        doomMap.numSegs, hb_map);
     doomMap.segSurfaces[2] = (surface_t**)Mem_Calloc(sizeof(surface_t*) *
-        doomMap.numSegs, hb_static);
+        doomMap.numSegs, hb_map);
+
+    // every seg gives at most three surfaces and every leaf two
+    surfaces.Reserve(doomMap.numSegs * 3 + doomMap.numSSects * 2);
 
     printf("------------- Building seg surfaces -------------\n");
 
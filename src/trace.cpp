@@ -27,16 +27,164 @@
 //
 //-----------------------------------------------------------------------------
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// sse2 comes with every x86-64 cpu so the edge tests can always use it there
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRACE_EDGES_SSE
+#include <emmintrin.h>
+#endif
+
 #include "common.h"
 #include "mapData.h"
 #include "trace.h"
 
+#define BVH_MAX_LEAF_SURFACES   4
+#define BVH_MAX_DEPTH           64
+#define BVH_BOUNDS_EPSILON      1.0f
+
+//
+// AddPointToBounds
+//
+
+static void AddPointToBounds(kexBBox &bounds, const kexVec3 &point) {
+    for(int i = 0; i < 3; i++) {
+        if(point[i] < bounds.min[i]) bounds.min[i] = point[i];
+        if(point[i] > bounds.max[i]) bounds.max[i] = point[i];
+    }
+}
+
+//
+// EdgesInside
+//
+// Tests a ray against a run of surface edges, a group at a time. Seg
+// edges must all have the ray a little on their inner side, the edges
+// of floors and ceilings only must not have it outside. Padding edges
+// are zero and pass either test. Takes the same float steps as
+// kexPluecker::InnerProduct
+//
+
+static bool EdgesInside(const kexPluecker &r, const traceSurfaces_t &table,
+                        const int first, const int count, const bool bSeg) {
+#ifdef TRACE_EDGES_SSE
+    __m128 r0 = _mm_set1_ps(r.p[0]);
+    __m128 r1 = _mm_set1_ps(r.p[1]);
+    __m128 r2 = _mm_set1_ps(r.p[2]);
+    __m128 r3 = _mm_set1_ps(r.p[3]);
+    __m128 r4 = _mm_set1_ps(r.p[4]);
+    __m128 r5 = _mm_set1_ps(r.p[5]);
+    __m128 d;
+    int i;
+
+    for(i = first; i < first + count; i += TRACE_EDGE_GROUP) {
+        d = _mm_mul_ps(r0, _mm_loadu_ps(&table.edges[4][i]));
+        d = _mm_add_ps(d, _mm_mul_ps(r1, _mm_loadu_ps(&table.edges[5][i])));
+        d = _mm_add_ps(d, _mm_mul_ps(r2, _mm_loadu_ps(&table.edges[3][i])));
+        d = _mm_add_ps(d, _mm_mul_ps(r4, _mm_loadu_ps(&table.edges[0][i])));
+        d = _mm_add_ps(d, _mm_mul_ps(r5, _mm_loadu_ps(&table.edges[1][i])));
+        d = _mm_add_ps(d, _mm_mul_ps(r3, _mm_loadu_ps(&table.edges[2][i])));
+
+        if(bSeg) {
+            if(_mm_movemask_ps(_mm_sub_ps(d, _mm_set1_ps(0.001f))) != 0xF) {
+                return false;
+            }
+        }
+        else if(_mm_movemask_ps(_mm_cmpgt_ps(d, _mm_setzero_ps())) != 0) {
+            return false;
+        }
+    }
+#else
+    float d;
+    int i;
+
+    for(i = first; i < first + count; i++) {
+        d =
+            r.p[0] * table.edges[4][i] +
+            r.p[1] * table.edges[5][i] +
+            r.p[2] * table.edges[3][i] +
+            r.p[4] * table.edges[0][i] +
+            r.p[5] * table.edges[1][i] +
+            r.p[3] * table.edges[2][i];
+
+        if(bSeg) {
+            d -= 0.001f;
+
+            if(!FLOATSIGNBIT(d)) {
+                return false;
+            }
+        }
+        else if(d > 0) {
+            return false;
+        }
+    }
+#endif
+
+    return true;
+}
+
+#ifdef TRACE_PACKET_SIMD
+
+//
+// CPUSupportsSSE2
+//
+
+static bool CPUSupportsSSE2(void) {
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 1);
+    return (info[3] & BIT(26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2") != 0;
+#endif
+}
+
+//
+// CPUSupportsAVX2
+//
+
+static bool CPUSupportsAVX2(void) {
+#ifdef _MSC_VER
+    int info[4];
+
+    __cpuid(info, 0);
+    if(info[0] < 7) {
+        return false;
+    }
+
+    // the os also has to save the ymm registers
+    __cpuid(info, 1);
+    if(!(info[2] & BIT(27)) || !(info[2] & BIT(28)) || (_xgetbv(0) & 6) != 6) {
+        return false;
+    }
+
+    __cpuidex(info, 7, 0);
+    return (info[1] & BIT(5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif
+
 //
 // kexTrace::kexTrace
 //
 
 kexTrace::kexTrace(void) {
-    this->map = NULL;
+    this->map           = NULL;
+    this->accel         = TRACE_ACCEL_BSP;
+    this->bvhNodes      = NULL;
+    this->bvhSurfaces   = NULL;
+    this->numBVHNodes   = 0;
+    this->packetFunc    = NULL;
+    this->packetSize    = 1;
+
+    memset(&this->table, 0, sizeof(traceSurfaces_t));
 }
 
 //
@@ -52,6 +200,360 @@ kexTrace::~kexTrace(void) {
 
 void kexTrace::Init(kexDoomMap &doomMap) {
     map = &doomMap;
+    bvhNodes = NULL;
+    bvhSurfaces = NULL;
+    numBVHNodes = 0;
+
+    BuildSurfaceTable();
+
+    if(accel == TRACE_ACCEL_BVH) {
+        BuildBVH();
+    }
+
+    packetFunc = NULL;
+    packetSize = 1;
+
+#ifdef TRACE_PACKET_SIMD
+    // packets only go through the bsp
+    if(bvhNodes == NULL) {
+        if(CPUSupportsAVX2()) {
+            packetFunc = TracePacketAVX2;
+            packetSize = 8;
+        }
+        else if(CPUSupportsSSE2()) {
+            packetFunc = TracePacketSSE;
+            packetSize = 4;
+        }
+    }
+#endif
+}
+
+//
+// kexTrace::BuildSurfaceTable
+//
+// Lays out the planes, types and edges of every surface for the ray
+// tests. Edges are in the same order and direction TraceSurface used
+// to build them in for each ray
+//
+
+void kexTrace::BuildSurfaceTable(void) {
+    surface_t *surf;
+    kexPluecker edge[4];
+    int numEdges;
+    int first;
+    int i;
+    int j;
+
+    table.numSurfaces = surfaces.Length();
+
+    for(i = 0; i < 3; i++) {
+        table.segSurfaces[i] = (int*)Mem_Malloc(sizeof(int) * map->numSegs, hb_map);
+
+        for(j = 0; j < map->numSegs; j++) {
+            table.segSurfaces[i][j] = -1;
+        }
+    }
+
+    for(i = 0; i < 2; i++) {
+        table.leafSurfaces[i] = (int*)Mem_Malloc(sizeof(int) * map->numSSects, hb_map);
+
+        for(j = 0; j < map->numSSects; j++) {
+            table.leafSurfaces[i][j] = -1;
+        }
+    }
+
+    if(table.numSurfaces == 0) {
+        return;
+    }
+
+    table.planes = (kexPlane*)Mem_Malloc(sizeof(kexPlane) * table.numSurfaces, hb_map);
+    table.types = (byte*)Mem_Malloc(table.numSurfaces, hb_map);
+    table.firstEdge = (int*)Mem_Malloc(sizeof(int) * table.numSurfaces, hb_map);
+    table.numEdges = (int*)Mem_Malloc(sizeof(int) * table.numSurfaces, hb_map);
+
+    numEdges = 0;
+
+    for(i = 0; i < table.numSurfaces; i++) {
+        surf = surfaces[i];
+
+        table.planes[i] = surf->plane;
+        table.types[i] = surf->type;
+        table.firstEdge[i] = numEdges;
+
+        switch(surf->type) {
+        case ST_MIDDLESEG:
+            table.segSurfaces[0][surf->typeIndex] = i;
+            table.numEdges[i] = 4;
+            break;
+        case ST_LOWERSEG:
+            table.segSurfaces[1][surf->typeIndex] = i;
+            table.numEdges[i] = 4;
+            break;
+        case ST_UPPERSEG:
+            table.segSurfaces[2][surf->typeIndex] = i;
+            table.numEdges[i] = 4;
+            break;
+        case ST_FLOOR:
+            table.leafSurfaces[0][surf->typeIndex] = i;
+            table.numEdges[i] = surf->numVerts;
+            break;
+        case ST_CEILING:
+            table.leafSurfaces[1][surf->typeIndex] = i;
+            table.numEdges[i] = surf->numVerts;
+            break;
+        default:
+            table.numEdges[i] = 0;
+            break;
+        }
+
+        numEdges += (table.numEdges[i] + TRACE_EDGE_GROUP - 1) & ~(TRACE_EDGE_GROUP - 1);
+    }
+
+    for(j = 0; j < 6; j++) {
+        table.edges[j] = (float*)Mem_Calloc(sizeof(float) * MAX(numEdges, 1), hb_map);
+    }
+
+    for(i = 0; i < table.numSurfaces; i++) {
+        surf = surfaces[i];
+        first = table.firstEdge[i];
+
+        // segs are always made up of 4 vertices, so its safe to assume 4 edges here
+        if(surf->type >= ST_MIDDLESEG && surf->type <= ST_LOWERSEG) {
+            edge[0].SetLine(surf->verts[2], surf->verts[3]); // top edge
+            edge[1].SetLine(surf->verts[1], surf->verts[0]); // bottom edge
+            edge[2].SetLine(surf->verts[3], surf->verts[1]); // right edge
+            edge[3].SetLine(surf->verts[0], surf->verts[2]); // left edge
+
+            for(j = 0; j < 4; j++) {
+                for(int k = 0; k < 6; k++) {
+                    table.edges[k][first + j] = edge[j].p[k];
+                }
+            }
+            continue;
+        }
+
+        for(j = 0; j < table.numEdges[i]; j++) {
+            edge[0].SetLine(surf->verts[(j+1)%surf->numVerts], surf->verts[j]);
+
+            for(int k = 0; k < 6; k++) {
+                table.edges[k][first + j] = edge[0].p[k];
+            }
+        }
+    }
+}
+
+//
+// kexTrace::BuildBVH
+//
+
+void kexTrace::BuildBVH(void) {
+    kexBBox *bounds;
+    kexVec3 *centers;
+    surface_t *surf;
+    unsigned int i;
+    int j;
+
+    if(surfaces.Length() == 0) {
+        return;
+    }
+
+    printf("------------- Building surface BVH -------------\n");
+
+    bvhSurfaces = (int*)Mem_Calloc(sizeof(int) * surfaces.Length(), hb_static);
+    bvhNodes = (traceNode_t*)Mem_Calloc(sizeof(traceNode_t) * surfaces.Length() * 2, hb_static);
+    bounds = (kexBBox*)Mem_Calloc(sizeof(kexBBox) * surfaces.Length(), hb_static);
+    centers = (kexVec3*)Mem_Calloc(sizeof(kexVec3) * surfaces.Length(), hb_static);
+
+    for(i = 0; i < surfaces.Length(); i++) {
+        surf = surfaces[i];
+
+        bounds[i].min = surf->verts[0];
+        bounds[i].max = surf->verts[0];
+
+        for(j = 1; j < surf->numVerts; j++) {
+            AddPointToBounds(bounds[i], surf->verts[j]);
+        }
+
+        // pad the box so flat and axis aligned surfaces are never missed
+        bounds[i] += BVH_BOUNDS_EPSILON;
+
+        centers[i] = bounds[i].Center();
+        bvhSurfaces[i] = i;
+    }
+
+    numBVHNodes = 0;
+    BuildBVHNode(0, surfaces.Length(), bounds, centers, 0);
+
+    Mem_Free(bounds);
+    Mem_Free(centers);
+
+    printf("BVH nodes: %i\n\n", numBVHNodes);
+}
+
+//
+// kexTrace::BuildBVHNode
+//
+// Splits the surfaces at the spatial median of the longest axis
+// of their centers. Returns the index of the new node
+//
+
+int kexTrace::BuildBVHNode(const int first, const int count, kexBBox *bounds,
+                           kexVec3 *centers, const int depth) {
+    traceNode_t *node;
+    kexBBox centerBounds;
+    kexVec3 extents;
+    int nodeNum;
+    int axis;
+    int mid;
+    int i;
+    float split;
+
+    nodeNum = numBVHNodes++;
+    node = &bvhNodes[nodeNum];
+
+    node->min = bounds[first].min;
+    node->max = bounds[first].max;
+    centerBounds.min = centers[first];
+    centerBounds.max = centers[first];
+
+    for(i = first + 1; i < first + count; i++) {
+        for(int j = 0; j < 3; j++) {
+            if(bounds[i].min[j] < node->min[j]) node->min[j] = bounds[i].min[j];
+            if(bounds[i].max[j] > node->max[j]) node->max[j] = bounds[i].max[j];
+        }
+
+        AddPointToBounds(centerBounds, centers[i]);
+    }
+
+    if(count <= BVH_MAX_LEAF_SURFACES || depth >= BVH_MAX_DEPTH - 1) {
+        node->first = first;
+        node->count = count;
+        node->axis = 0;
+        return nodeNum;
+    }
+
+    extents = centerBounds.max - centerBounds.min;
+
+    if(extents.x >= extents.y && extents.x >= extents.z) {
+        axis = 0;
+    }
+    else if(extents.y >= extents.z) {
+        axis = 1;
+    }
+    else {
+        axis = 2;
+    }
+
+    split = (centerBounds.min[axis] + centerBounds.max[axis]) * 0.5f;
+    mid = first;
+
+    for(i = first; i < first + count; i++) {
+        if(centers[i][axis] < split) {
+            int tSurf = bvhSurfaces[i];
+            kexBBox tBounds = bounds[i];
+            kexVec3 tCenter = centers[i];
+
+            bvhSurfaces[i] = bvhSurfaces[mid];
+            bounds[i] = bounds[mid];
+            centers[i] = centers[mid];
+
+            bvhSurfaces[mid] = tSurf;
+            bounds[mid] = tBounds;
+            centers[mid] = tCenter;
+            mid++;
+        }
+    }
+
+    // all centers landed on one side so just cut the list in half
+    if(mid == first || mid == first + count) {
+        mid = first + (count >> 1);
+    }
+
+    node->count = 0;
+    node->axis = axis;
+
+    BuildBVHNode(first, mid - first, bounds, centers, depth + 1);
+
+    // the node list has been written to by the left subtree
+    node = &bvhNodes[nodeNum];
+    node->first = BuildBVHNode(mid, first + count - mid, bounds, centers, depth + 1);
+
+    return nodeNum;
+}
+
+//
+// kexTrace::CastRay
+//
+
+void kexTrace::CastRay(traceRay_t &ray, const kexVec3 &startVec,
+                       const kexVec3 &endVec, const bool bAnyHit) const {
+    ray.start = startVec;
+    ray.end = endVec;
+    ray.dir = (endVec - startVec).Normalize();
+    ray.line.SetRay(ray.start, ray.dir);
+    ray.bAnyHit = bAnyHit;
+    ray.result.hitNormal.Clear();
+    ray.result.hitVector.Clear();
+    ray.result.hitSurface = NULL;
+    ray.result.fraction = 1;
+
+    if(bvhNodes != NULL) {
+        TraceBVH(ray);
+    }
+    else if(map != NULL) {
+        TraceBSPNode(ray, map->numNodes - 1);
+    }
+}
+
+//
+// kexTrace::TraceRay
+//
+// Does not touch any state of the tracer so it can be
+// called from any number of threads at once
+//
+
+traceResult_t kexTrace::TraceRay(const kexVec3 &startVec, const kexVec3 &endVec) const {
+    traceRay_t ray;
+
+    CastRay(ray, startVec, endVec, false);
+    return ray.result;
+}
+
+//
+// kexTrace::TraceOcclusion
+//
+// Returns true if anything lies between the two points. Gives up on
+// the first contact found instead of searching for the nearest one
+//
+
+bool kexTrace::TraceOcclusion(const kexVec3 &startVec, const kexVec3 &endVec) const {
+    traceRay_t ray;
+
+    CastRay(ray, startVec, endVec, true);
+    return ray.result.hitSurface != NULL;
+}
+
+//
+// kexTrace::TraceOcclusionPacket
+//
+// Same as calling TraceOcclusion for every end point, but rays are
+// traced through the bsp in packets when the cpu allows it
+//
+
+void kexTrace::TraceOcclusionPacket(const kexVec3 &startVec, const kexVec3 *endVecs,
+                                    const int count, bool *blocked) const {
+    int i;
+
+    if(packetFunc == NULL) {
+        for(i = 0; i < count; i++) {
+            blocked[i] = TraceOcclusion(startVec, endVecs[i]);
+        }
+        return;
+    }
+
+    for(i = 0; i < count; i += packetSize) {
+        packetFunc(map, &table, startVec, &endVecs[i], MIN(packetSize, count - i), &blocked[i]);
+    }
 }
 
 //
@@ -59,46 +561,38 @@ void kexTrace::Init(kexDoomMap &doomMap) {
 //
 
 void kexTrace::Trace(const kexVec3 &startVec, const kexVec3 &endVec) {
+    traceResult_t result = TraceRay(startVec, endVec);
+
     start = startVec;
     end = endVec;
     dir = (end - start).Normalize();
-    hitNormal.Clear();
-    hitVector.Clear();
-    hitSurface = NULL;
-    fraction = 1;
-
-    if(map == NULL) {
-        return;
-    }
-
-    TraceBSPNode(map->numNodes - 1);
+    hitNormal = result.hitNormal;
+    hitVector = result.hitVector;
+    hitSurface = result.hitSurface;
+    fraction = result.fraction;
 }
 
 //
 // kexTrace::TraceSurface
 //
 
-void kexTrace::TraceSurface(surface_t *surface) {
+void kexTrace::TraceSurface(traceRay_t &ray, const int num) const {
     kexPlane *plane;
     kexVec3 hit;
-    kexVec3 edge1;
-    kexVec3 edge2;
     kexVec3 normal;
     float d1;
     float d2;
-    float d;
     float frac;
-    int i;
-    kexPluecker r;
+    byte type;
 
-    if(surface == NULL) {
+    if(num < 0) {
         return;
     }
 
-    plane = &surface->plane;
+    plane = &table.planes[num];
 
-    d1 = plane->Distance(start) - plane->d;
-    d2 = plane->Distance(end) - plane->d;
+    d1 = plane->Distance(ray.start) - plane->d;
+    d2 = plane->Distance(ray.end) - plane->d;
 
     if(d1 <= d2 || d1 < 0 || d2 > 0) {
         // trace is either completely in front or behind the plane
@@ -112,68 +606,33 @@ void kexTrace::TraceSurface(surface_t *surface) {
         return;
     }
 
-    if(frac >= fraction) {
+    if(frac >= ray.result.fraction) {
         // farther than the current contact
         return;
     }
 
-    hit = start.Lerp(end, frac);
+    hit = ray.start.Lerp(ray.end, frac);
     normal = plane->Normal();
 
-    r.SetRay(start, dir);
-
-    // segs are always made up of 4 vertices, so its safe to assume 4 edges here
-    if(surface->type >= ST_MIDDLESEG && surface->type <= ST_LOWERSEG) {
-        kexPluecker p1;
-        kexPluecker p2;
-        kexPluecker p3;
-        kexPluecker p4;
-        byte sideBits = 0;
-
-        p1.SetLine(surface->verts[2], surface->verts[3]); // top edge
-        p2.SetLine(surface->verts[1], surface->verts[0]); // bottom edge
-        p3.SetLine(surface->verts[3], surface->verts[1]); // right edge
-        p4.SetLine(surface->verts[0], surface->verts[2]); // left edge
-
-        d = r.InnerProduct(p1)-0.001f; sideBits |= (FLOATSIGNBIT(d) << 0);
-        d = r.InnerProduct(p2)-0.001f; sideBits |= (FLOATSIGNBIT(d) << 1);
-        d = r.InnerProduct(p3)-0.001f; sideBits |= (FLOATSIGNBIT(d) << 2);
-        d = r.InnerProduct(p4)-0.001f; sideBits |= (FLOATSIGNBIT(d) << 3);
-
-        if(sideBits != 0xF) {
-            return;
-        }
-    }
-    else if(surface->type == ST_FLOOR || surface->type == ST_CEILING) {
-        kexPluecker p;
-        kexVec3 v1;
-        kexVec3 v2;
-
-        for(i = 0; i < surface->numVerts; i++) {
-            v1 = surface->verts[i];
-            v2 = surface->verts[(i+1)%surface->numVerts];
-
-            p.SetLine(v2, v1);
-
-            d = r.InnerProduct(p);
+    type = table.types[num];
 
-            if(r.InnerProduct(p) > 0) {
-                return;
-            }
-        }
+    if(type >= ST_MIDDLESEG && type <= ST_FLOOR &&
+       !EdgesInside(ray.line, table, table.firstEdge[num], table.numEdges[num],
+                    type <= ST_LOWERSEG)) {
+        return;
     }
 
-    hitNormal = normal;
-    hitVector = hit;
-    hitSurface = surface;
-    fraction = frac;
+    ray.result.hitNormal = normal;
+    ray.result.hitVector = hit;
+    ray.result.hitSurface = surfaces[num];
+    ray.result.fraction = frac;
 }
 
 //
 // kexTrace::TraceSubSector
 //
 
-void kexTrace::TraceSubSector(int num) {
+void kexTrace::TraceSubSector(traceRay_t &ray, int num) const {
     mapSubSector_t *sub;
     int i;
     int j;
@@ -183,13 +642,21 @@ void kexTrace::TraceSubSector(int num) {
     // test line segments
     for(i = 0; i < sub->numsegs; i++) {
         for(j = 0; j < 3; j++) {
-            TraceSurface(map->segSurfaces[j][sub->firstseg + i]);
+            TraceSurface(ray, table.segSurfaces[j][sub->firstseg + i]);
+
+            if(ray.bAnyHit && ray.result.hitSurface) {
+                return;
+            }
         }
     }
 
     // test subsector leafs
     for(j = 0; j < 2; j++) {
-        TraceSurface(map->leafSurfaces[j][num]);
+        TraceSurface(ray, table.leafSurfaces[j][num]);
+
+        if(ray.bAnyHit && ray.result.hitSurface) {
+            return;
+        }
     }
 }
 
@@ -197,7 +664,7 @@ void kexTrace::TraceSubSector(int num) {
 // kexTrace::TraceBSPNode
 //
 
-void kexTrace::TraceBSPNode(int num) {
+void kexTrace::TraceBSPNode(traceRay_t &ray, int num) const {
     mapNode_t *node;
     kexVec3 dp1;
     kexVec3 dp2;
@@ -205,7 +672,7 @@ void kexTrace::TraceBSPNode(int num) {
     byte side;
 
     if(num & NF_SUBSECTOR) {
-        TraceSubSector(num & (~NF_SUBSECTOR));
+        TraceSubSector(ray, num & (~NF_SUBSECTOR));
         return;
     }
 
@@ -214,20 +681,109 @@ void kexTrace::TraceBSPNode(int num) {
     kexVec3 pt1(F(node->x << 16), F(node->y << 16), 0);
     kexVec3 pt2(F(node->dx << 16), F(node->dy << 16), 0);
 
-    dp1 = pt1 - start;
-    dp2 = (pt2 + pt1) - start;
+    dp1 = pt1 - ray.start;
+    dp2 = (pt2 + pt1) - ray.start;
     d = dp1.Cross(dp2).z;
 
     side = FLOATSIGNBIT(d);
 
-    TraceBSPNode(node->children[side ^ 1]);
+    TraceBSPNode(ray, node->children[side ^ 1]);
 
-    dp1 = pt1 - end;
-    dp2 = (pt2 + pt1) - end;
+    if(ray.bAnyHit && ray.result.hitSurface) {
+        return;
+    }
+
+    dp1 = pt1 - ray.end;
+    dp2 = (pt2 + pt1) - ray.end;
     d = dp1.Cross(dp2).z;
 
     // don't trace if both ends of the ray are on the same side
     if(side != FLOATSIGNBIT(d)) {
-        TraceBSPNode(node->children[side]);
+        TraceBSPNode(ray, node->children[side]);
+    }
+}
+
+//
+// kexTrace::TraceBVH
+//
+
+void kexTrace::TraceBVH(traceRay_t &ray) const {
+    int stack[BVH_MAX_DEPTH];
+    int stackCount;
+    const traceNode_t *node;
+    kexVec3 delta;
+    float invDelta[3];
+    float tmin;
+    float tmax;
+    float t1;
+    float t2;
+    int i;
+
+    delta = ray.end - ray.start;
+
+    for(i = 0; i < 3; i++) {
+        invDelta[i] = (delta[i] != 0) ? 1.0f / delta[i] : 0;
+    }
+
+    stack[0] = 0;
+    stackCount = 1;
+
+    while(stackCount > 0) {
+        node = &bvhNodes[stack[--stackCount]];
+
+        // clip the ray against the node box, only
+        // looking for contacts closer than the current one
+        tmin = 0;
+        tmax = ray.result.fraction;
+
+        for(i = 0; i < 3; i++) {
+            if(delta[i] == 0) {
+                if(ray.start[i] < node->min[i] || ray.start[i] > node->max[i]) {
+                    break;
+                }
+                continue;
+            }
+
+            t1 = (node->min[i] - ray.start[i]) * invDelta[i];
+            t2 = (node->max[i] - ray.start[i]) * invDelta[i];
+
+            if(t1 > t2) {
+                float t = t1;
+                t1 = t2;
+                t2 = t;
+            }
+
+            if(t1 > tmin) tmin = t1;
+            if(t2 < tmax) tmax = t2;
+
+            if(tmin > tmax) {
+                break;
+            }
+        }
+
+        if(i != 3) {
+            continue;
+        }
+
+        if(node->count != 0) {
+            for(i = 0; i < node->count; i++) {
+                TraceSurface(ray, bvhSurfaces[node->first + i]);
+
+                if(ray.bAnyHit && ray.result.hitSurface) {
+                    return;
+                }
+            }
+            continue;
+        }
+
+        // visit the child nearest to the start of the ray first
+        if(delta[node->axis] < 0) {
+            stack[stackCount++] = (node - bvhNodes) + 1;
+            stack[stackCount++] = node->first;
+        }
+        else {
+            stack[stackCount++] = node->first;
+            stack[stackCount++] = (node - bvhNodes) + 1;
+        }
     }
 }
@@ -27,12 +27,83 @@
 
 class kexDoomMap;
 
+// packet tracers are only built for x86 cpus
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#define TRACE_PACKET_SIMD
+#endif
+
+#define TRACE_PACKET_MAX    8
+
+//
+// packed copy of the surface data that ray tests read, indexed by surface
+// number (its place in the surfaces list). edges of each surface are
+// stored as pluecker lines so rays never have to rebuild them, with one
+// array per line component. the edges of a surface start on a multiple
+// of TRACE_EDGE_GROUP and are padded with zero lines up to the next one.
+// the lightmap side of surface_t is only looked up once a contact is made
+//
+#define TRACE_EDGE_GROUP    4
+
+typedef struct {
+    kexPlane            *planes;
+    byte                *types;
+    int                 *firstEdge;
+    int                 *numEdges;
+    float               *edges[6];
+    int                 *segSurfaces[3];    // -1 where there is no surface
+    int                 *leafSurfaces[2];
+    int                 numSurfaces;
+} traceSurfaces_t;
+
+typedef void (*tracePacketFunc_t)(const kexDoomMap *map, const traceSurfaces_t *table,
+                                  const kexVec3 &startVec, const kexVec3 *endVecs,
+                                  const int count, bool *blocked);
+
+typedef enum {
+    TRACE_ACCEL_BSP     = 0,
+    TRACE_ACCEL_BVH
+} traceAccel_t;
+
+typedef struct {
+    kexVec3             hitNormal;
+    kexVec3             hitVector;
+    surface_t           *hitSurface;
+    float               fraction;
+} traceResult_t;
+
+typedef struct {
+    kexVec3             start;
+    kexVec3             end;
+    kexVec3             dir;
+    kexPluecker         line;
+    bool                bAnyHit;    // stop at the first contact found
+    traceResult_t       result;
+} traceRay_t;
+
+//
+// bounding volume node. children of a node are laid out depth first so the
+// left child always follows its parent. leafs reference a contiguous run
+// of surfaces in the bvh surface list
+//
+typedef struct {
+    kexVec3             min;
+    kexVec3             max;
+    int                 first;      // first surface for leafs, right child otherwise
+    short               count;      // 0 for inner nodes
+    short               axis;       // split axis for inner nodes
+} traceNode_t;
+
 class kexTrace {
 public:
                         kexTrace(void);
                         ~kexTrace(void);
 
     void                Init(kexDoomMap &doomMap);
+    traceResult_t       TraceRay(const kexVec3 &startVec, const kexVec3 &endVec) const;
+    bool                TraceOcclusion(const kexVec3 &startVec, const kexVec3 &endVec) const;
+    void                TraceOcclusionPacket(const kexVec3 &startVec, const kexVec3 *endVecs,
+                                             const int count, bool *blocked) const;
+    int                 PacketSize(void) const { return packetSize; }
     void                Trace(const kexVec3 &startVec, const kexVec3 &endVec);
 
     kexVec3             start;
@@ -42,14 +113,36 @@ public:
     kexVec3             hitVector;
     surface_t           *hitSurface;
     float               fraction;
+    traceAccel_t        accel;
 
 private:
-    void                TraceBSPNode(int num);
-    void                TraceSubSector(int num);
-    void                TraceSurface(surface_t *surface);
+    void                CastRay(traceRay_t &ray, const kexVec3 &startVec,
+                                 const kexVec3 &endVec, const bool bAnyHit) const;
+    void                TraceBSPNode(traceRay_t &ray, int num) const;
+    void                TraceSubSector(traceRay_t &ray, int num) const;
+    void                TraceSurface(traceRay_t &ray, const int num) const;
+    void                TraceBVH(traceRay_t &ray) const;
+    void                BuildSurfaceTable(void);
+    void                BuildBVH(void);
+    int                 BuildBVHNode(const int first, const int count, kexBBox *bounds,
+                                     kexVec3 *centers, const int depth);
 
     kexDoomMap          *map;
-
+    traceSurfaces_t     table;
+    traceNode_t         *bvhNodes;
+    int                 *bvhSurfaces;
+    int                 numBVHNodes;
+    tracePacketFunc_t   packetFunc;
+    int                 packetSize;
 };
 
+#ifdef TRACE_PACKET_SIMD
+void TracePacketSSE(const kexDoomMap *map, const traceSurfaces_t *table,
+                    const kexVec3 &startVec, const kexVec3 *endVecs,
+                    const int count, bool *blocked);
+void TracePacketAVX2(const kexDoomMap *map, const traceSurfaces_t *table,
+                     const kexVec3 &startVec, const kexVec3 *endVecs,
+                     const int count, bool *blocked);
+#endif
+
 #endif
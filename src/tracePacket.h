@@ -0,0 +1,332 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 
+ //   2. Altered source versions must be plainly marked as such, and must not be
+ //   misrepresented as being the original software.
+// 
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+// 
+
+#ifndef __TRACEPACKET_H__
+#define __TRACEPACKET_H__
+
+//
+// Packet tracer shared by the SSE and AVX2 units. Traces a group of
+// occlusion rays that start at the same point through the BSP together,
+// one ray per SIMD lane. The lane type supplies the vector operations
+// and is defined by the unit that includes this header, which is then
+// compiled with the matching instruction set. Stay away from inline
+// functions from other headers in here, as those could end up being
+// shared with code that runs on any cpu.
+//
+// Every lane must take the same float steps as kexTrace::TraceSurface
+// and kexTrace::TraceBSPNode so the results match the scalar path bit
+// for bit. Keep the two in sync.
+//
+
+template<class lane_t>
+class kexTracePacket {
+public:
+    typedef typename lane_t::vec_t  vec_t;
+
+                        kexTracePacket(const kexDoomMap *doomMap, const traceSurfaces_t *surfaceTable);
+
+    void                Trace(const kexVec3 &startVec, const kexVec3 *endVecs,
+                              const int count, bool *blocked);
+
+private:
+    void                TraceBSPNode(int num, int mask);
+    int                 TraceSubSector(int num, int mask);
+    int                 TraceSurface(const int num, int mask);
+    vec_t               InnerProduct(const int edge) const;
+
+    const kexDoomMap    *map;
+    const traceSurfaces_t *table;
+    kexVec3             start;
+    vec_t               end[3];
+    vec_t               line[6];
+    int                 hitMask;
+};
+
+//
+// kexTracePacket::kexTracePacket
+//
+
+template<class lane_t>
+kexTracePacket<lane_t>::kexTracePacket(const kexDoomMap *doomMap,
+                                       const traceSurfaces_t *surfaceTable) {
+    this->map       = doomMap;
+    this->table     = surfaceTable;
+    this->hitMask   = 0;
+}
+
+//
+// kexTracePacket::Trace
+//
+
+template<class lane_t>
+void kexTracePacket<lane_t>::Trace(const kexVec3 &startVec, const kexVec3 *endVecs,
+                                   const int count, bool *blocked) {
+    float v[3][lane_t::width];
+    vec_t dir[3];
+    vec_t d;
+    vec_t s;
+    int i;
+    int j;
+
+    start = startVec;
+
+    // unused lanes repeat the last ray and are masked off
+    for(i = 0; i < lane_t::width; i++) {
+        const kexVec3 &e = endVecs[i < count ? i : count - 1];
+
+        v[0][i] = e.x;
+        v[1][i] = e.y;
+        v[2][i] = e.z;
+    }
+
+    for(j = 0; j < 3; j++) {
+        end[j] = lane_t::Load(v[j]);
+    }
+
+    dir[0] = lane_t::Sub(end[0], lane_t::Set(start.x));
+    dir[1] = lane_t::Sub(end[1], lane_t::Set(start.y));
+    dir[2] = lane_t::Sub(end[2], lane_t::Set(start.z));
+
+    // same steps as kexVec3::Normalize
+    d = lane_t::Add(lane_t::Add(
+        lane_t::Mul(dir[0], dir[0]),
+        lane_t::Mul(dir[1], dir[1])),
+        lane_t::Mul(dir[2], dir[2]));
+    d = lane_t::Sqrt(d);
+    s = lane_t::CmpNE(d, lane_t::Set(0));
+    d = lane_t::Div(lane_t::Set(1), d);
+
+    for(j = 0; j < 3; j++) {
+        dir[j] = lane_t::Select(s, lane_t::Mul(dir[j], d), dir[j]);
+    }
+
+    // same steps as kexPluecker::SetRay
+    line[0] = lane_t::Sub(lane_t::Mul(lane_t::Set(start.x), dir[1]),
+                          lane_t::Mul(dir[0], lane_t::Set(start.y)));
+    line[1] = lane_t::Sub(lane_t::Mul(lane_t::Set(start.x), dir[2]),
+                          lane_t::Mul(dir[0], lane_t::Set(start.z)));
+    line[3] = lane_t::Sub(lane_t::Mul(lane_t::Set(start.y), dir[2]),
+                          lane_t::Mul(dir[1], lane_t::Set(start.z)));
+    line[2] = lane_t::Neg(dir[0]);
+    line[5] = dir[1];
+    line[4] = lane_t::Neg(dir[2]);
+
+    hitMask = 0;
+    TraceBSPNode(map->numNodes - 1, (1 << count) - 1);
+
+    for(i = 0; i < count; i++) {
+        blocked[i] = (hitMask & BIT(i)) != 0;
+    }
+}
+
+//
+// kexTracePacket::InnerProduct
+//
+
+template<class lane_t>
+typename kexTracePacket<lane_t>::vec_t
+kexTracePacket<lane_t>::InnerProduct(const int edge) const {
+    vec_t d;
+
+    d = lane_t::Mul(line[0], lane_t::Set(table->edges[4][edge]));
+    d = lane_t::Add(d, lane_t::Mul(line[1], lane_t::Set(table->edges[5][edge])));
+    d = lane_t::Add(d, lane_t::Mul(line[2], lane_t::Set(table->edges[3][edge])));
+    d = lane_t::Add(d, lane_t::Mul(line[4], lane_t::Set(table->edges[0][edge])));
+    d = lane_t::Add(d, lane_t::Mul(line[5], lane_t::Set(table->edges[1][edge])));
+    d = lane_t::Add(d, lane_t::Mul(line[3], lane_t::Set(table->edges[2][edge])));
+
+    return d;
+}
+
+//
+// kexTracePacket::TraceSurface
+//
+// Returns the lanes in mask that hit the surface
+//
+
+template<class lane_t>
+int kexTracePacket<lane_t>::TraceSurface(const int num, int mask) {
+    kexPlane *plane;
+    int first;
+    vec_t d1;
+    vec_t d2;
+    vec_t d;
+    vec_t frac;
+    vec_t reject;
+    int i;
+
+    if(num < 0) {
+        return 0;
+    }
+
+    plane = &table->planes[num];
+
+    // the start point is shared so only the end of each ray needs testing
+    d1 = lane_t::Set(plane->Distance(start) - plane->d);
+    d2 = lane_t::Sub(lane_t::Add(lane_t::Add(
+        lane_t::Mul(end[0], lane_t::Set(plane->a)),
+        lane_t::Mul(end[1], lane_t::Set(plane->b))),
+        lane_t::Mul(end[2], lane_t::Set(plane->c))),
+        lane_t::Set(plane->d));
+
+    reject = lane_t::Or(lane_t::Or(
+        lane_t::CmpLE(d1, d2),
+        lane_t::CmpLT(d1, lane_t::Set(0))),
+        lane_t::CmpGT(d2, lane_t::Set(0)));
+
+    frac = lane_t::Div(d1, lane_t::Sub(d1, d2));
+
+    // no contact has been found yet, so the current fraction is always 1
+    reject = lane_t::Or(reject, lane_t::Or(lane_t::Or(
+        lane_t::CmpGT(frac, lane_t::Set(1)),
+        lane_t::CmpLT(frac, lane_t::Set(0))),
+        lane_t::CmpGE(frac, lane_t::Set(1))));
+
+    mask &= ~lane_t::SignMask(reject);
+
+    if(mask == 0) {
+        return 0;
+    }
+
+    first = table->firstEdge[num];
+
+    if(table->types[num] >= ST_MIDDLESEG && table->types[num] <= ST_LOWERSEG) {
+        for(i = 0; i < 4 && mask != 0; i++) {
+            d = lane_t::Sub(InnerProduct(first + i), lane_t::Set(0.001f));
+            mask &= lane_t::SignMask(d);
+        }
+    }
+    else if(table->types[num] == ST_FLOOR || table->types[num] == ST_CEILING) {
+        for(i = 0; i < table->numEdges[num] && mask != 0; i++) {
+            d = InnerProduct(first + i);
+            mask &= ~lane_t::SignMask(lane_t::CmpGT(d, lane_t::Set(0)));
+        }
+    }
+
+    return mask;
+}
+
+//
+// kexTracePacket::TraceSubSector
+//
+// Returns the lanes in mask that are still looking for a contact
+//
+
+template<class lane_t>
+int kexTracePacket<lane_t>::TraceSubSector(int num, int mask) {
+    const mapSubSector_t *sub;
+    int hits;
+    int i;
+    int j;
+
+    sub = &map->mapSSects[num];
+
+    // test line segments
+    for(i = 0; i < sub->numsegs; i++) {
+        for(j = 0; j < 3; j++) {
+            hits = TraceSurface(table->segSurfaces[j][sub->firstseg + i], mask);
+
+            hitMask |= hits;
+            mask &= ~hits;
+
+            if(mask == 0) {
+                return 0;
+            }
+        }
+    }
+
+    // test subsector leafs
+    for(j = 0; j < 2; j++) {
+        hits = TraceSurface(table->leafSurfaces[j][num], mask);
+
+        hitMask |= hits;
+        mask &= ~hits;
+
+        if(mask == 0) {
+            return 0;
+        }
+    }
+
+    return mask;
+}
+
+//
+// kexTracePacket::TraceBSPNode
+//
+
+template<class lane_t>
+void kexTracePacket<lane_t>::TraceBSPNode(int num, int mask) {
+    const mapNode_t *node;
+    kexVec3 dp1;
+    kexVec3 dp2;
+    vec_t x1;
+    vec_t y1;
+    vec_t x2;
+    vec_t y2;
+    float d;
+    byte side;
+    int sideMask;
+
+    if(num & NF_SUBSECTOR) {
+        TraceSubSector(num & (~NF_SUBSECTOR), mask);
+        return;
+    }
+
+    node = &map->nodes[num];
+
+    kexVec3 pt1(F(node->x << 16), F(node->y << 16), 0);
+    kexVec3 pt2(F(node->dx << 16), F(node->dy << 16), 0);
+    kexVec3 pt3 = pt2 + pt1;
+
+    dp1 = pt1 - start;
+    dp2 = pt3 - start;
+    d = dp1.Cross(dp2).z;
+
+    side = FLOATSIGNBIT(d);
+
+    // every ray starts on the same side so they all take the near child
+    TraceBSPNode(node->children[side ^ 1], mask);
+
+    mask &= ~hitMask;
+
+    if(mask == 0) {
+        return;
+    }
+
+    x1 = lane_t::Sub(lane_t::Set(pt1.x), end[0]);
+    y1 = lane_t::Sub(lane_t::Set(pt1.y), end[1]);
+    x2 = lane_t::Sub(lane_t::Set(pt3.x), end[0]);
+    y2 = lane_t::Sub(lane_t::Set(pt3.y), end[1]);
+
+    sideMask = lane_t::SignMask(lane_t::Sub(lane_t::Mul(x1, y2), lane_t::Mul(x2, y1)));
+
+    // only rays that end on the other side go on to the far child
+    mask &= side ? ~sideMask : sideMask;
+
+    if(mask != 0) {
+        TraceBSPNode(node->children[side], mask);
+    }
+}
+
+#endif
@@ -0,0 +1,82 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 
+ //   2. Altered source versions must be plainly marked as such, and must not be
+ //   misrepresented as being the original software.
+// 
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+// 
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: AVX2 packet tracer, eight rays per packet
+//
+//-----------------------------------------------------------------------------
+
+#include "common.h"
+#include "mapData.h"
+#include "trace.h"
+
+#ifdef TRACE_PACKET_SIMD
+
+#include <immintrin.h>
+
+#include "tracePacket.h"
+
+namespace {
+
+struct avxLane_t {
+    typedef __m256 vec_t;
+
+    static const int width = 8;
+
+    static vec_t Load(const float *f) { return _mm256_loadu_ps(f); }
+    static vec_t Set(const float f) { return _mm256_set1_ps(f); }
+    static vec_t Add(const vec_t a, const vec_t b) { return _mm256_add_ps(a, b); }
+    static vec_t Sub(const vec_t a, const vec_t b) { return _mm256_sub_ps(a, b); }
+    static vec_t Mul(const vec_t a, const vec_t b) { return _mm256_mul_ps(a, b); }
+    static vec_t Div(const vec_t a, const vec_t b) { return _mm256_div_ps(a, b); }
+    static vec_t Sqrt(const vec_t a) { return _mm256_sqrt_ps(a); }
+    static vec_t Neg(const vec_t a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+    static vec_t Or(const vec_t a, const vec_t b) { return _mm256_or_ps(a, b); }
+    static vec_t CmpLT(const vec_t a, const vec_t b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+    static vec_t CmpLE(const vec_t a, const vec_t b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+    static vec_t CmpGT(const vec_t a, const vec_t b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static vec_t CmpGE(const vec_t a, const vec_t b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+    static vec_t CmpNE(const vec_t a, const vec_t b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+    static int SignMask(const vec_t a) { return _mm256_movemask_ps(a); }
+
+    static vec_t Select(const vec_t mask, const vec_t a, const vec_t b) {
+        return _mm256_blendv_ps(b, a, mask);
+    }
+};
+
+}
+
+//
+// TracePacketAVX2
+//
+
+void TracePacketAVX2(const kexDoomMap *map, const traceSurfaces_t *table,
+                     const kexVec3 &startVec, const kexVec3 *endVecs,
+                     const int count, bool *blocked) {
+    kexTracePacket<avxLane_t> packet(map, table);
+
+    packet.Trace(startVec, endVecs, count, blocked);
+}
+
+#endif
@@ -43,16 +43,46 @@ kexWadFile::~kexWadFile(void) {
 //
 
 bool kexWadFile::Open(const char *fileName) {
-    if(!file.Open(fileName)) {
+    if(!file.OpenMapped(fileName, hb_file)) {
         return false;
     }
 
     memcpy(&header, file.Buffer(), sizeof(wadHeader_t));
     lumps = (lump_t*)file.GetOffset(2);
     wadName = fileName;
+
+    HashLumps();
     return true;
 }
 
+//
+// kexWadFile::HashLumps
+//
+// Chains every lump into a bucket by name. Lumps are linked in back to
+// front so each chain runs in directory order and lookups still find
+// the first lump with a given name
+//
+
+void kexWadFile::HashLumps(void) {
+    char n[9];
+    int hash;
+
+    lumpHashNext = (int*)Mem_Malloc(sizeof(int) * (header.lmpcount + 1), hb_file);
+
+    for(int i = 0; i < MAX_HASH; i++) {
+        lumpHashHeads[i] = -1;
+    }
+
+    for(int i = header.lmpcount - 1; i >= 0; i--) {
+        strncpy(n, lumps[i].name, 8);
+        n[8] = 0;
+
+        hash = kexStr::Hash(n);
+        lumpHashNext[i] = lumpHashHeads[hash];
+        lumpHashHeads[hash] = i;
+    }
+}
+
 //
 // kexWadFile::Close
 //
@@ -70,13 +100,11 @@ void kexWadFile::Close(void) {
 lump_t *kexWadFile::GetLumpFromName(const char *name) {
     char n[9];
 
-    for(int i = 0; i < header.lmpcount; i++) {
-        // could be optimized here but I really don't feel like
-        // wasting time on this
-        strncpy(n, lumps[i].name, 8);
-        n[8] = 0;
+    strncpy(n, name, 8);
+    n[8] = 0;
 
-        if(!strncmp(n, name, 8)) {
+    for(int i = lumpHashHeads[kexStr::Hash(n)]; i != -1; i = lumpHashNext[i]) {
+        if(!strncmp(lumps[i].name, n, 8)) {
             return &lumps[i];
         }
     }
@@ -108,19 +136,70 @@ byte *kexWadFile::GetLumpData(const char *name) {
     return &file.Buffer()[lump->filepos];
 }
 
+//
+// kexWadFile::IsMapLump
+//
+// A map marker is any lump that is followed by its THINGS
+//
+
+bool kexWadFile::IsMapLump(const int lump) {
+    if(lump < 0 || lump + 1 >= header.lmpcount) {
+        return false;
+    }
+
+    return !strncmp(lumps[lump + 1].name, "THINGS", 8);
+}
+
+//
+// kexWadFile::FindMap
+//
+
+int kexWadFile::FindMap(const char *name) {
+    lump_t *lump = GetLumpFromName(name);
+
+    if(lump == NULL || !IsMapLump(lump - lumps)) {
+        return -1;
+    }
+
+    return lump - lumps;
+}
+
+//
+// kexWadFile::FindAllMaps
+//
+
+void kexWadFile::FindAllMaps(kexArray<int> &mapList) {
+    for(int i = 0; i < header.lmpcount; i++) {
+        if(IsMapLump(i)) {
+            mapList.Push(i);
+        }
+    }
+}
+
 //
 // kexWadFile::SetCurrentMap
 //
 
 void kexWadFile::SetCurrentMap(const int map) {
-    lump_t *lump = GetLumpFromName(Va("MAP%02d", map));
+    int lump = FindMap(Va("MAP%02d", map));
     
-    if(lump == NULL) {
+    if(lump == -1) {
         Error("kexWadFile::SetCurrentMap: MAP%02d not found\n", map);
         return;
     }
     
-    mapLumpID = lump - lumps;
+    SetCurrentMapLump(lump);
+}
+
+//
+// kexWadFile::SetCurrentMapLump
+//
+
+void kexWadFile::SetCurrentMapLump(const int lump) {
+    mapLumpID = lump;
+
+    strncpy(mapName, lumps[lump].name, 8);
+    mapName[8] = 0;
 }
 
 //
@@ -135,19 +214,44 @@ lump_t *kexWadFile::GetMapLump(mapLumps_t lumpID) {
     return &lumps[mapLumpID + lumpID];
 }
 
+//
+// kexWadFile::AddLightmapLump
+//
+// Queues the lightmap lump for the current map, all of them
+// get written by a single BuildNewWad
+//
+
+void kexWadFile::AddLightmapLump(byte *data, const int size) {
+    lightmapLump_t lightmap;
+
+    lightmap.mapLumpID = mapLumpID;
+    lightmap.data = data;
+    lightmap.size = size;
+
+    lightmapLumps.Push(lightmap);
+}
+
 //
 // kexWadFile::BuildNewWad
 //
 
-void kexWadFile::BuildNewWad(byte *lightmapLump, const int size) {
+void kexWadFile::BuildNewWad(void) {
     wadHeader_t newHeader;
     lump_t lump;
-    lump_t *lmLump;
+    lightmapLump_t *lit;
     kexArray<lump_t> lumpList;
+    kexArray<int> sourceList;
     kexArray<byte*> dataList;
     int pos;
+    int start;
+    int length;
     kexBinFile wadFile;
-    kexStr backupName;
+    kexBinFile dirFile;
+    byte *dir;
+    kexStr tempName;
+    unsigned int i;
+    unsigned int k;
+    bool bOldLightmap;
 
     newHeader.id[0] = 'P';
     newHeader.id[1] = 'W';
@@ -159,29 +263,51 @@ void kexWadFile::BuildNewWad(byte *lightmapLump, const int size) {
     newHeader.lmpcount = 0;
     newHeader.lmpdirpos = pos;
 
-    lmLump = GetMapLump(ML_LIGHTMAP);
+    lumpList.Reserve(header.lmpcount + lightmapLumps.Length());
+    sourceList.Reserve(header.lmpcount + lightmapLumps.Length());
+    dataList.Reserve(header.lmpcount + lightmapLumps.Length());
+
+    for(int j = 0; j < header.lmpcount; j++) {
+        lit = NULL;
+        bOldLightmap = false;
+
+        for(k = 0; k < lightmapLumps.Length(); k++) {
+            if(j >= lightmapLumps[k].mapLumpID && j <= lightmapLumps[k].mapLumpID + ML_MACROS) {
+                lit = &lightmapLumps[k];
+            }
+
+            // maps that were never lit have whatever comes next here
+            if(j == lightmapLumps[k].mapLumpID + ML_LIGHTMAP &&
+               !strncmp(lumps[j].name, "LIGHTMAP", 8)) {
+                bOldLightmap = true;
+            }
+        }
 
-    for(int i = 0; i < header.lmpcount; i++) {
         // don't re-add old lightmap lump
-        if(lmLump != NULL && i == (mapLumpID + ML_LIGHTMAP)) {
+        if(bOldLightmap) {
             continue;
         }
 
-        lump = lumps[i];
+        lump = lumps[j];
         lump.filepos = pos;
         lumpList.Push(lump);
-        dataList.Push(GetLumpData(lumps[i].name));
+        sourceList.Push(lumps[j].filepos);
+
+        // lumps of lit maps may have been patched in memory (light things
+        // get their options cleared), the rest are copied from the file
+        dataList.Push(lit ? GetLumpData(&lumps[j]) : NULL);
 
         newHeader.lmpcount++;
         newHeader.lmpdirpos += lump.size;
         pos += lump.size;
 
-        if(i == (mapLumpID + ML_MACROS)) {
+        if(lit && j == lit->mapLumpID + ML_MACROS) {
             lump.filepos = pos;
-            lump.size = size;
+            lump.size = lit->size;
             strncpy(lump.name, "LIGHTMAP", 8);
             lumpList.Push(lump);
-            dataList.Push(lightmapLump);
+            sourceList.Push(-1);
+            dataList.Push(lit->data);
 
             newHeader.lmpcount++;
             newHeader.lmpdirpos += lump.size;
@@ -189,33 +315,70 @@ void kexWadFile::BuildNewWad(byte *lightmapLump, const int size) {
         }
     }
 
-    backupName = wadName;
-    backupName.StripExtension();
-    wadFile.Duplicate(backupName + "_backup.wad");
+    // write next to the original and swap it in once complete, so a
+    // failed rebuild never leaves a truncated wad behind
+    tempName = wadName + ".tmp";
+
+    if(!wadFile.Create(tempName)) {
+        Error("kexWadFile::BuildNewWad: couldn't create %s\n", tempName.c_str());
+        return;
+    }
 
-    wadFile.Create(wadName);
-    wadFile.Write8(newHeader.id[0]);
-    wadFile.Write8(newHeader.id[1]);
-    wadFile.Write8(newHeader.id[2]);
-    wadFile.Write8(newHeader.id[3]);
+    wadFile.WriteBytes((byte*)newHeader.id, 4);
     wadFile.Write32(newHeader.lmpcount);
     wadFile.Write32(newHeader.lmpdirpos);
 
-    for(unsigned int i = 0; i < lumpList.Length(); i++) {
-        byte *data = dataList[i];
+    i = 0;
 
-        for(int j = 0; j < lumpList[i].size; j++) {
-            wadFile.Write8(data[j]);
+    while(i < lumpList.Length()) {
+        if(dataList[i] != NULL) {
+            wadFile.WriteBytes(dataList[i], lumpList[i].size);
+            i++;
+            continue;
         }
-    }
 
-    for(unsigned int i = 0; i < lumpList.Length(); i++) {
-        wadFile.Write32(lumpList[i].filepos);
-        wadFile.Write32(lumpList[i].size);
-        for(int j = 0; j < 8; j++) {
-            wadFile.Write8(lumpList[i].name[j]);
+        // lumps that were already back to back in the old wad are
+        // copied over as one range
+        start = sourceList[i];
+        length = 0;
+
+        while(i < lumpList.Length() && dataList[i] == NULL &&
+              sourceList[i] == start + length) {
+            length += lumpList[i++].size;
         }
+
+        wadFile.CopyFrom(file, start, length);
+    }
+
+    // assemble the directory in memory and write it out in one go
+    dir = (byte*)Mem_Malloc(lumpList.Length() * sizeof(lump_t), hb_static);
+    dirFile.SetBuffer(dir);
+
+    for(i = 0; i < lumpList.Length(); i++) {
+        dirFile.Write32(lumpList[i].filepos);
+        dirFile.Write32(lumpList[i].size);
+        dirFile.WriteBytes((byte*)lumpList[i].name, 8);
+    }
+
+    wadFile.WriteBytes(dir, lumpList.Length() * sizeof(lump_t));
+    Mem_Free(dir);
+
+    if(!wadFile.Close()) {
+        remove(tempName);
+        Error("kexWadFile::BuildNewWad: couldn't write %s\n", tempName.c_str());
+        return;
     }
 
-    wadFile.Close();
+    // nothing is read from the old wad anymore, and windows
+    // won't replace a file that is still open
+    Close();
+
+#ifdef _WIN32
+    // rename won't replace an existing file here
+    remove(wadName);
+#endif
+
+    if(rename(tempName, wadName) != 0) {
+        Error("kexWadFile::BuildNewWad: couldn't replace %s\n", wadName.c_str());
+    }
 }
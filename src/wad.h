@@ -58,6 +58,12 @@ typedef struct {
     char                name[8];
 } lump_t;
 
+typedef struct {
+    int                 mapLumpID;
+    byte                *data;
+    int                 size;
+} lightmapLump_t;
+
 class kexWadFile {
 public:
                         ~kexWadFile(void);
@@ -66,6 +72,7 @@ public:
     lump_t              *lumps;
     unsigned int        size;
     int                 mapLumpID;
+    char                mapName[9];
     kexStr              wadName;
 
     lump_t              *GetLumpFromName(const char *name);
@@ -73,9 +80,14 @@ public:
     byte                *GetLumpData(const lump_t *lump);
     byte                *GetLumpData(const char *name);
     void                SetCurrentMap(const int map);    
+    void                SetCurrentMapLump(const int lump);
+    bool                IsMapLump(const int lump);
+    int                 FindMap(const char *name);
+    void                FindAllMaps(kexArray<int> &mapList);
     bool                Open(const char *fileName);
     void                Close(void);
-    void                BuildNewWad(byte *lightmapLump, const int size);
+    void                AddLightmapLump(byte *data, const int size);
+    void                BuildNewWad(void);
 
     template<typename type>
     void                GetMapLump(mapLumps_t lumpID, type **ptr, int *count) {
@@ -91,7 +103,12 @@ public:
     }
 
 private:
+    void                HashLumps(void);
+
     kexBinFile          file;
+    kexArray<lightmapLump_t> lightmapLumps;
+    int                 lumpHashHeads[MAX_HASH];
+    int                 *lumpHashNext;
 };
 
 #endif
@@ -0,0 +1,213 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 
+ //   2. Altered source versions must be plainly marked as such, and must not be
+ //   misrepresented as being the original software.
+// 
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+// 
+//-----------------------------------------------------------------------------
+//
+// DESCRIPTION: Worker thread pool. Each thread owns a range of jobs and
+//              steals half of another thread's remaining range once its
+//              own range runs dry.
+//
+//-----------------------------------------------------------------------------
+
+#include <thread>
+
+#include "common.h"
+#include "worker.h"
+
+//
+// kexWorker::kexWorker
+//
+
+kexWorker::kexWorker(void) {
+    this->numThreads    = 1;
+    this->queues        = NULL;
+    this->jobData       = NULL;
+    this->jobFunc       = NULL;
+}
+
+//
+// kexWorker::~kexWorker
+//
+
+kexWorker::~kexWorker(void) {
+    if(queues) {
+        delete[] queues;
+    }
+}
+
+//
+// kexWorker::NumCPUs
+//
+
+int kexWorker::NumCPUs(void) {
+    int count = (int)std::thread::hardware_concurrency();
+
+    return count <= 0 ? 1 : count;
+}
+
+//
+// kexWorker::SetNumThreads
+//
+
+void kexWorker::SetNumThreads(const int count) {
+    numThreads = count;
+
+    if(numThreads <= 0) {
+        numThreads = NumCPUs();
+    }
+}
+
+//
+// kexWorker::GetJob
+//
+
+bool kexWorker::GetJob(const int thread, int *job) {
+    jobQueue_t *queue = &queues[thread];
+
+    while(1) {
+        queue->lock.lock();
+
+        if(queue->head < queue->tail) {
+            *job = queue->head++;
+            queue->lock.unlock();
+            return true;
+        }
+
+        queue->lock.unlock();
+
+        if(!StealJobs(thread)) {
+            return false;
+        }
+    }
+
+    return false;
+}
+
+//
+// kexWorker::StealJobs
+//
+// Takes the back half of the first non-empty queue found
+// and hands it over to this thread's queue
+//
+
+bool kexWorker::StealJobs(const int thread) {
+    jobQueue_t *victim;
+    int head;
+    int tail;
+
+    for(int i = 1; i < numThreads; i++) {
+        victim = &queues[(thread + i) % numThreads];
+
+        victim->lock.lock();
+
+        if(victim->head >= victim->tail) {
+            victim->lock.unlock();
+            continue;
+        }
+
+        tail = victim->tail;
+        head = tail - ((tail - victim->head + 1) >> 1);
+        victim->tail = head;
+
+        victim->lock.unlock();
+
+        queues[thread].lock.lock();
+        queues[thread].head = head;
+        queues[thread].tail = tail;
+        queues[thread].lock.unlock();
+        return true;
+    }
+
+    return false;
+}
+
+//
+// kexWorker::RunThread
+//
+
+void kexWorker::RunThread(const int thread) {
+    int job;
+
+    while(GetJob(thread, &job)) {
+        jobFunc(jobData, job, thread);
+    }
+}
+
+//
+// kexWorker::ThreadMain
+//
+
+void kexWorker::ThreadMain(kexWorker *worker, const int thread) {
+    worker->RunThread(thread);
+}
+
+//
+// kexWorker::RunJobs
+//
+// Calls jobFunc once for every job in [0, count). The calling thread
+// takes part as thread 0 and blocks until all jobs are done
+//
+
+void kexWorker::RunJobs(const int count, void *data, jobFunc_t func) {
+    std::thread *threads;
+    int i;
+
+    if(count <= 0) {
+        return;
+    }
+
+    if(numThreads <= 1) {
+        for(i = 0; i < count; i++) {
+            func(data, i, 0);
+        }
+        return;
+    }
+
+    if(queues) {
+        delete[] queues;
+    }
+
+    queues = new jobQueue_t[numThreads];
+    jobData = data;
+    jobFunc = func;
+
+    // split the jobs into even ranges
+    for(i = 0; i < numThreads; i++) {
+        queues[i].head = (int)(((long long)count * i) / numThreads);
+        queues[i].tail = (int)(((long long)count * (i + 1)) / numThreads);
+    }
+
+    threads = new std::thread[numThreads - 1];
+
+    for(i = 1; i < numThreads; i++) {
+        threads[i - 1] = std::thread(ThreadMain, this, i);
+    }
+
+    RunThread(0);
+
+    for(i = 1; i < numThreads; i++) {
+        threads[i - 1].join();
+    }
+
+    delete[] threads;
+}
@@ -0,0 +1,62 @@
+//
+// Copyright (c) 2013-2014 Samuel Villarreal
+// svkaiser@gmail.com
+// 
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+// 
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+// 
+//    1. The origin of this software must not be misrepresented; you must not
+//    claim that you wrote the original software. If you use this software
+//    in a product, an acknowledgment in the product documentation would be
+//    appreciated but is not required.
+// 
+ //   2. Altered source versions must be plainly marked as such, and must not be
+ //   misrepresented as being the original software.
+// 
+//    3. This notice may not be removed or altered from any source
+//    distribution.
+// 
+
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <mutex>
+
+typedef void (*jobFunc_t)(void *data, const int job, const int thread);
+
+typedef struct {
+    std::mutex          lock;
+    int                 head;
+    int                 tail;
+} jobQueue_t;
+
+class kexWorker {
+public:
+                        kexWorker(void);
+                        ~kexWorker(void);
+
+    void                SetNumThreads(const int count);
+    void                RunJobs(const int count, void *data, jobFunc_t jobFunc);
+    int                 NumThreads(void) const { return numThreads; }
+
+    static int          NumCPUs(void);
+
+private:
+    bool                GetJob(const int thread, int *job);
+    bool                StealJobs(const int thread);
+    void                RunThread(const int thread);
+
+    static void         ThreadMain(kexWorker *worker, const int thread);
+
+    int                 numThreads;
+    jobQueue_t          *queues;
+    void                *jobData;
+    jobFunc_t           jobFunc;
+};
+
+#endif